@@ -4,9 +4,53 @@
 
 #include <cstring>
 #include <iostream>
+#include <vector>
 
 using namespace vsharp;
 
+// frames of protocol v2 are not confirmed, so broken framing is detected by the limit of the frame length
+static const int maxFrameLength = 1 << 30;
+
+bool Protocol::readExactly(char *buffer, int count) {
+    int bytesRead = 0;
+    while (bytesRead < count) {
+        int newBytesCount = m_communicator.read(buffer + bytesRead, count - bytesRead);
+        if (newBytesCount <= 0) break;
+        bytesRead += newBytesCount;
+    }
+    if (bytesRead != count) {
+        LOG_ERROR(tout << "Communication with server: expected " << count << " bytes, but read " << bytesRead << " bytes");
+        return false;
+    }
+    return true;
+}
+
+bool Protocol::writeExactly(const char *buffer, int count) {
+    int bytesWritten = 0;
+    while (bytesWritten < count) {
+        int newBytesCount = m_communicator.write(const_cast<char *>(buffer) + bytesWritten, count - bytesWritten);
+        if (newBytesCount <= 0) break;
+        bytesWritten += newBytesCount;
+    }
+    if (bytesWritten != count) {
+        LOG_ERROR(tout << "Communication with server: could not sent the message. Instead sent " << bytesWritten << " bytes");
+        return false;
+    }
+    return true;
+}
+
+void Protocol::queue(const char *bytes, int count) {
+    m_outgoing.insert(m_outgoing.end(), bytes, bytes + count);
+}
+
+bool Protocol::flush() {
+    if (m_outgoing.empty())
+        return true;
+    bool result = writeExactly(m_outgoing.data(), (int)m_outgoing.size());
+    m_outgoing.clear();
+    return result;
+}
+
 bool Protocol::readConfirmation() {
     char *buffer = new char[1];
     int bytesRead = m_communicator.read(buffer, 1);
@@ -23,7 +67,8 @@ bool Protocol::readConfirmation() {
 }
 
 bool Protocol::writeConfirmation() {
-    int bytesWritten = m_communicator.write(new char[1] {Confirmation}, 1);
+    char confirmation = Confirmation;
+    int bytesWritten = m_communicator.write(&confirmation, 1);
     if (bytesWritten != 1) {
         LOG_ERROR(tout << "Communication with server: could not send the confirmation message. Instead sent"
                        << bytesWritten << " bytes.");
@@ -33,9 +78,14 @@ bool Protocol::writeConfirmation() {
 }
 
 bool Protocol::readCount(int &count) {
-    int countCount = m_communicator.read((char*)(&count), 4);
-    if (countCount != 4) {
-        LOG_ERROR(tout << "Communication with server: could not get the amount of bytes of the next message. Instead read " << countCount << " bytes");
+    // every message of the server is an answer, so the queued frames are sent before waiting for it
+    if (!flush()) {
+        LOG_ERROR(tout << "Communication with server: could not send queued messages.");
+        return false;
+    }
+    // without confirmations the count may arrive together with the previous frame, so it is read in parts
+    if (!readExactly((char*)(&count), 4)) {
+        LOG_ERROR(tout << "Communication with server: could not get the amount of bytes of the next message.");
         return false;
     }
 
@@ -55,28 +105,18 @@ bool Protocol::readBuffer(char *&buffer, int &count) {
     if (!readCount(count)) {
         return false;
     }
-    if (count <= 0) {
-        LOG_ERROR(tout << "Communication with server: the amount of bytes is unexpectedly non-positive (count = " << count << ") ");
+    if (count <= 0 || m_version == ProtocolV2 && count > maxFrameLength) {
+        LOG_ERROR(tout << "Communication with server: the amount of bytes is unexpected (count = " << count << ") ");
         return false;
     }
-    if (!writeConfirmation()) return false;
+    if (m_version == ProtocolV1 && !writeConfirmation()) return false;
     buffer = new char[count];
-    char *bufferBeginning = buffer;
-    int bytesRead = 0;
-    while (bytesRead < count) {
-        int newBytesCount = m_communicator.read(buffer, count - bytesRead);
-        if (newBytesCount == 0) break;
-        bytesRead += newBytesCount;
-        buffer += newBytesCount;
-    }
-    buffer = bufferBeginning;
-    if (bytesRead != count) {
-        LOG_ERROR(tout << "Communication with server: expected " << count << " bytes, but read " << bytesRead << " bytes");
+    if (!readExactly(buffer, count)) {
         delete[] buffer;
         buffer = nullptr;
         return false;
     }
-    if (!writeConfirmation()) {
+    if (m_version == ProtocolV1 && !writeConfirmation()) {
         LOG_ERROR(tout << "Communication with server: I've got the message, but could not confirm it.");
         delete[] buffer;
         buffer = nullptr;
@@ -85,7 +125,32 @@ bool Protocol::readBuffer(char *&buffer, int &count) {
     return true;
 }
 
+// reads the message into the reused buffer, which grows only for the biggest message
+bool Protocol::readBuffer(std::vector<char> &buffer, int &count) {
+    if (!readCount(count)) {
+        return false;
+    }
+    if (count <= 0 || m_version == ProtocolV2 && count > maxFrameLength) {
+        LOG_ERROR(tout << "Communication with server: the amount of bytes is unexpected (count = " << count << ") ");
+        return false;
+    }
+    if (m_version == ProtocolV1 && !writeConfirmation()) return false;
+    if (buffer.size() < (size_t)count)
+        buffer.resize(count);
+    if (!readExactly(buffer.data(), count)) return false;
+    if (m_version == ProtocolV1 && !writeConfirmation()) {
+        LOG_ERROR(tout << "Communication with server: I've got the message, but could not confirm it.");
+        return false;
+    }
+    return true;
+}
+
 bool Protocol::writeBuffer(char *buffer, int count) {
+    if (m_version == ProtocolV2) {
+        queue((const char *)&count, sizeof(int));
+        queue(buffer, count);
+        return true;
+    }
     if (!writeCount(count) || !readConfirmation()) {
         return false;
     }
@@ -101,24 +166,46 @@ bool Protocol::writeBuffer(char *buffer, int count) {
     return true;
 }
 
+// v1: the command byte and the payload are sent as separate buffers; v2: one [command][count][payload] frame
+bool Protocol::writeCommandFrame(char commandByte, const char *buffer, int count) {
+    if (m_version == ProtocolV1) {
+        char command = commandByte;
+        return writeBuffer(&command, 1) && writeBuffer(const_cast<char *>(buffer), count);
+    }
+    queue(&commandByte, sizeof(char));
+    queue((const char *)&count, sizeof(int));
+    queue(buffer, count);
+    return true;
+}
+
+// The server greets with "Hi!" (version 1 only) or "Hi!v2" (version 2 supported), the reply selects the version;
+// the handshake itself is always framed by version 1
 bool Protocol::handshake() {
-    const char *expectedMessage = "Hi!";
+    const char *greetingV1 = "Hi!";
+    const char *greetingV2 = "Hi!v2";
     char *message;
     int count;
-    if (readBuffer(message, count) && !strcmp(message, expectedMessage)) {
-        strcpy(message, "Hi!");
-        count = strlen(message);
-        if (writeBuffer(message, count)) {
-            delete[] message;
-            LOG(tout << "Communication with server: handshake success!");
-            return true;
-        }
+    if (readBuffer(message, count)) {
+        bool isV1 = count == (int)strlen(greetingV1) && !memcmp(message, greetingV1, count);
+        bool isV2 = count == (int)strlen(greetingV2) && !memcmp(message, greetingV2, count);
         delete[] message;
+        if (isV1 || isV2) {
+            const char *reply = isV2 ? greetingV2 : greetingV1;
+            if (writeBuffer(const_cast<char *>(reply), (int)strlen(reply))) {
+                m_version = isV2 ? ProtocolV2 : ProtocolV1;
+                LOG(tout << "Communication with server: handshake success! Protocol version " << m_version);
+                return true;
+            }
+        }
     }
     LOG_ERROR(tout << "Communication with server: handshake failed!");
     return false;
 }
 
+ProtocolVersion Protocol::version() const {
+    return m_version;
+}
+
 bool Protocol::startSession() {
     return connect() && sendProbes();
 }
@@ -197,7 +284,7 @@ bool Protocol::acceptMethodBody(char *&bytecode, int &codeLength, unsigned &maxS
     return true;
 }
 
-void Protocol::acceptExecResult(char *&bytes, int &messageLength) {
+void Protocol::acceptExecResult(std::vector<char> &bytes, int &messageLength) {
     if (!readBuffer(bytes, messageLength)) {
         FAIL_LOUD("Exec response validation failed!");
     }
@@ -211,5 +298,10 @@ bool Protocol::connect() {
 
 bool Protocol::shutdown()
 {
-    return writeCount(-1);
+    int count = -1;
+    if (m_version == ProtocolV2) {
+        queue((const char *)&count, sizeof(int));
+        return flush();
+    }
+    return writeCount(count);
 }
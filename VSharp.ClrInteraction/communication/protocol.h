@@ -2,6 +2,7 @@
 #define PROTOCOL_H_
 
 #include "communicator.h"
+#include <vector>
 
 namespace vsharp {
 
@@ -13,9 +14,24 @@ enum CommandType {
     ReadString = 0x59
 };
 
+// Version 1 confirms every count and payload; version 2 sends length-prefixed frames without confirmations
+enum ProtocolVersion {
+    ProtocolV1 = 1,
+    ProtocolV2 = 2
+};
+
 class Protocol {
 private:
     Communicator m_communicator;
+    ProtocolVersion m_version = ProtocolV1;
+    // frames of protocol v2 are queued here and sent by one write, when an answer of the server is awaited
+    std::vector<char> m_outgoing;
+
+    void queue(const char *bytes, int count);
+    bool flush();
+
+    bool readExactly(char *buffer, int count);
+    bool writeExactly(const char *buffer, int count);
 
     bool readConfirmation();
     bool writeConfirmation();
@@ -24,6 +40,7 @@ private:
     bool writeCount(int count);
 
     bool readBuffer(char *&buffer, int &count);
+    bool readBuffer(std::vector<char> &buffer, int &count);
     bool writeBuffer(char *buffer, int count);
 
     bool handshake();
@@ -32,6 +49,7 @@ public:
     bool connect();
     bool sendProbes();
     bool startSession();
+    ProtocolVersion version() const;
     void acceptEntryPoint(char *&entryPointBytes, int &length);
     bool acceptCommand(CommandType &command);
     bool acceptString(char *&string);
@@ -39,15 +57,15 @@ public:
     bool acceptMethodBody(char *&bytecode, int &codeLength, unsigned &maxStackSize, char *&ehs, unsigned &ehsLength);
     template<typename T>
     bool sendSerializable(char commandByte, const T &object) {
-        if (!writeBuffer(new char[1] {commandByte}, 1)) return false;
         char *bytes;
         unsigned count;
         object.serialize(bytes, count);
-        bool result = writeBuffer(bytes, count);
+        bool result = writeCommandFrame(commandByte, bytes, (int)count);
         delete[] bytes;
         return result;
     }
-    void acceptExecResult(char *&bytes, int &messageLength);
+    bool writeCommandFrame(char commandByte, const char *buffer, int count);
+    void acceptExecResult(std::vector<char> &bytes, int &messageLength);
     bool shutdown();
 };
 
@@ -0,0 +1,177 @@
+#include "shmRing.h"
+#include "../logging.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace vsharp;
+
+static const int spinIterations = 2000;
+// blocking waits are bounded, so the closing of the peer is noticed without a wakeup
+static const long waitTimeoutNs = 100 * 1000 * 1000;
+
+static void waitSignal(std::atomic<uint32_t> &signal, uint32_t seen) {
+#ifdef __linux__
+    struct timespec timeout = {0, waitTimeoutNs};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&signal), FUTEX_WAIT, seen, &timeout, nullptr, 0);
+#else
+    (void) signal;
+    (void) seen;
+    struct timespec pause = {0, 50 * 1000};
+    nanosleep(&pause, nullptr);
+#endif
+}
+
+static void wakeSignal(std::atomic<uint32_t> &signal) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&signal), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#else
+    (void) signal;
+#endif
+}
+
+// Waits until 'ready' holds: spins for short waits, then blocks on the futex word 'signal'
+template<typename F>
+static bool waitFor(F ready, std::atomic<uint32_t> &signal, std::atomic<uint32_t> &waiting, const std::atomic<uint32_t> &closed) {
+    for (int i = 0; i < spinIterations; ++i) {
+        if (ready()) return true;
+        if (i % 64 == 63) sched_yield();
+    }
+    while (true) {
+        uint32_t seen = signal.load();
+        waiting.store(1);
+        // the peer bumps 'signal' after publishing, so the wait returns at once if it was published after 'seen'
+        if (ready()) {
+            waiting.store(0);
+            return true;
+        }
+        if (closed.load()) {
+            waiting.store(0);
+            return ready();
+        }
+        waitSignal(signal, seen);
+        waiting.store(0);
+    }
+}
+
+static void notify(std::atomic<uint32_t> &signal, const std::atomic<uint32_t> &waiting) {
+    signal.fetch_add(1);
+    if (waiting.load())
+        wakeSignal(signal);
+}
+
+//region ShmRing
+ShmRing::ShmRing(ShmRingControl *control, char *data, uint32_t capacity, const std::atomic<uint32_t> *closed)
+    : m_control(control), m_data(data), m_capacity(capacity), m_closed(closed) { }
+
+int ShmRing::read(char *buffer, int count) {
+    uint32_t tail = m_control->tail.load(std::memory_order_relaxed);
+    auto hasData = [this, tail]() { return m_control->head.load(std::memory_order_acquire) != tail; };
+    if (!waitFor(hasData, m_control->dataSignal, m_control->consumerWaiting, *m_closed))
+        return 0;
+
+    uint32_t available = m_control->head.load(std::memory_order_acquire) - tail;
+    auto size = std::min(available, (uint32_t) count);
+    uint32_t start = tail & (m_capacity - 1);
+    uint32_t first = std::min(size, m_capacity - start);
+    memcpy(buffer, m_data + start, first);
+    memcpy(buffer + first, m_data, size - first);
+    m_control->tail.store(tail + size, std::memory_order_release);
+    notify(m_control->spaceSignal, m_control->producerWaiting);
+    return (int) size;
+}
+
+int ShmRing::write(const char *buffer, int count) {
+    int written = 0;
+    while (written < count) {
+        uint32_t head = m_control->head.load(std::memory_order_relaxed);
+        auto hasSpace = [this, head]() { return head - m_control->tail.load(std::memory_order_acquire) < m_capacity; };
+        if (!waitFor(hasSpace, m_control->spaceSignal, m_control->producerWaiting, *m_closed))
+            break;
+
+        uint32_t space = m_capacity - (head - m_control->tail.load(std::memory_order_acquire));
+        auto size = std::min(space, (uint32_t) (count - written));
+        uint32_t start = head & (m_capacity - 1);
+        uint32_t first = std::min(size, m_capacity - start);
+        memcpy(m_data + start, buffer + written, first);
+        memcpy(m_data, buffer + written + first, size - first);
+        m_control->head.store(head + size, std::memory_order_release);
+        notify(m_control->dataSignal, m_control->consumerWaiting);
+        written += (int) size;
+    }
+    return written;
+}
+//endregion
+
+//region ShmTransport
+bool ShmTransport::open(const char *path) {
+    int fd = ::open(path, O_RDWR);
+    if (fd < 0) {
+        LOG_ERROR(tout << "Shared memory " << path << " can not be opened: " << strerror(errno));
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(ShmHeader)) {
+        LOG_ERROR(tout << "Shared memory " << path << " is too small");
+        ::close(fd);
+        return false;
+    }
+    m_size = (size_t) info.st_size;
+    m_mapping = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m_mapping == MAP_FAILED) {
+        LOG_ERROR(tout << "Shared memory " << path << " can not be mapped: " << strerror(errno));
+        m_mapping = nullptr;
+        return false;
+    }
+
+    m_header = (ShmHeader *) m_mapping;
+    uint32_t capacity = m_header->capacity;
+    size_t ringSize = sizeof(ShmRingControl) + capacity;
+    bool isPowerOfTwo = capacity != 0 && (capacity & (capacity - 1)) == 0;
+    if (m_header->magic != shmMagic || !isPowerOfTwo || sizeof(ShmHeader) + 2 * ringSize > m_size) {
+        LOG_ERROR(tout << "Shared memory " << path << " has unexpected layout");
+        close();
+        return false;
+    }
+
+    char *rings = (char *) m_mapping + sizeof(ShmHeader);
+    m_incoming = new ShmRing((ShmRingControl *) rings, rings + sizeof(ShmRingControl), capacity, &m_header->closed);
+    rings += ringSize;
+    m_outgoing = new ShmRing((ShmRingControl *) rings, rings + sizeof(ShmRingControl), capacity, &m_header->closed);
+    LOG(tout << "Communication via shared memory rings of " << capacity << " bytes");
+    return true;
+}
+
+int ShmTransport::read(char *buffer, int count) {
+    return m_incoming->read(buffer, count);
+}
+
+int ShmTransport::write(const char *buffer, int count) {
+    return m_outgoing->write(buffer, count);
+}
+
+bool ShmTransport::close() {
+    delete m_incoming;
+    delete m_outgoing;
+    m_incoming = nullptr;
+    m_outgoing = nullptr;
+    if (m_mapping == nullptr)
+        return true;
+    m_header->closed.store(1);
+    bool result = munmap(m_mapping, m_size) == 0;
+    m_mapping = nullptr;
+    m_header = nullptr;
+    return result;
+}
+//endregion
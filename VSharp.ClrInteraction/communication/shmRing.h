@@ -0,0 +1,70 @@
+#ifndef SHMRING_H_
+#define SHMRING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace vsharp {
+
+// NOTE: layout of the shared memory must match the concolic server:
+// [ShmHeader][server -> client ShmRingControl][data][client -> server ShmRingControl][data]
+// positions grow monotonically and wrap around 2^32, capacity is a power of two
+
+static const uint32_t shmMagic = 0x4D485356; // "VSHM"
+
+struct ShmHeader {
+    uint32_t magic;
+    uint32_t capacity;
+    std::atomic<uint32_t> closed;
+    char padding[52];
+};
+
+struct ShmRingControl {
+    std::atomic<uint32_t> head;             // written by the producer
+    char padding0[60];
+    std::atomic<uint32_t> tail;             // written by the consumer
+    char padding1[60];
+    std::atomic<uint32_t> dataSignal;       // futex word, bumped after publishing data
+    std::atomic<uint32_t> consumerWaiting;
+    char padding2[56];
+    std::atomic<uint32_t> spaceSignal;      // futex word, bumped after consuming data
+    std::atomic<uint32_t> producerWaiting;
+    char padding3[56];
+};
+
+static_assert(sizeof(ShmHeader) == 64, "ShmHeader must take one cache line");
+static_assert(sizeof(ShmRingControl) == 256, "ShmRingControl must take four cache lines");
+
+// Single-producer single-consumer byte stream; waiting spins first, then blocks on a futex
+class ShmRing {
+private:
+    ShmRingControl *m_control;
+    char *m_data;
+    uint32_t m_capacity;
+    const std::atomic<uint32_t> *m_closed;
+public:
+    ShmRing(ShmRingControl *control, char *data, uint32_t capacity, const std::atomic<uint32_t> *closed);
+    // returns the number of read bytes, like 'read' of a stream socket; 0 if the peer closed the transport
+    int read(char *buffer, int count);
+    // returns the number of written bytes; less than 'count' only if the peer closed the transport
+    int write(const char *buffer, int count);
+};
+
+class ShmTransport {
+private:
+    void *m_mapping = nullptr;
+    size_t m_size = 0;
+    ShmHeader *m_header = nullptr;
+    ShmRing *m_incoming = nullptr;
+    ShmRing *m_outgoing = nullptr;
+public:
+    bool open(const char *path);
+    int read(char *buffer, int count);
+    int write(const char *buffer, int count);
+    bool close();
+};
+
+}
+
+#endif // SHMRING_H_
@@ -1,4 +1,5 @@
 #include "communicator.h"
+#include "shmRing.h"
 #include "../logging.h"
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -9,6 +10,8 @@
 using namespace vsharp;
 
 int fd;
+// set if the server provides shared memory rings instead of the socket
+ShmTransport *shm = nullptr;
 
 bool reportError() {
     LOG_ERROR(tout << strerror(errno));
@@ -16,6 +19,16 @@ bool reportError() {
 }
 
 bool Communicator::open() {
+    auto shmFile = getenv("CONCOLIC_SHM");
+    if (shmFile != nullptr && strlen(shmFile) > 0) {
+        shm = new ShmTransport();
+        if (shm->open(shmFile))
+            return true;
+        delete shm;
+        shm = nullptr;
+        return false;
+    }
+
     fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (fd < 0)
         return reportError();
@@ -32,6 +45,8 @@ bool Communicator::open() {
 }
 
 int Communicator::read(char *buffer, int count) {
+    if (shm != nullptr)
+        return shm->read(buffer, count);
     int bytes = ::read(fd, buffer, count);
 //    LOG(tout << "read " << count << " bytes: " << buffer);
     if (bytes < 0) reportError();
@@ -39,6 +54,8 @@ int Communicator::read(char *buffer, int count) {
 }
 
 int Communicator::write(char *message, int count) {
+    if (shm != nullptr)
+        return shm->write(message, count);
 //    LOG(tout << "writing " << count << " bytes: " << message);
     int bytes = ::write(fd, message, count);
     if (bytes < 0) reportError();
@@ -46,6 +63,12 @@ int Communicator::write(char *message, int count) {
 }
 
 bool Communicator::close() {
+    if (shm != nullptr) {
+        bool result = shm->close();
+        delete shm;
+        shm = nullptr;
+        return result;
+    }
     if (::close(fd)) 
         return reportError();
     return true;   
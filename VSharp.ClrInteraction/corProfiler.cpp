@@ -44,6 +44,9 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
         COR_PRF_MONITOR_GC |
         COR_PRF_ENABLE_OBJECT_ALLOCATED |
         COR_PRF_MONITOR_OBJECT_ALLOCATED |
+        COR_PRF_MONITOR_CLASS_LOADS |
+        COR_PRF_MONITOR_MODULE_LOADS |
+        COR_PRF_MONITOR_THREADS |
         COR_PRF_ENABLE_REJIT;
 
     // TODO: place IfFailRet here, log fails!
@@ -167,6 +170,9 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadFinished(ModuleID moduleId, H
 {
     UNUSED(moduleId);
     UNUSED(hrStatus);
+    // cached types may refer to classes of the module via their type arguments
+    std::lock_guard<std::mutex> lock(typeCacheMutex);
+    typeCache.clear();
     return S_OK;
 }
 
@@ -198,8 +204,9 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ClassUnloadStarted(ClassID classId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ClassUnloadFinished(ClassID classId, HRESULT hrStatus)
 {
-    UNUSED(classId);
     UNUSED(hrStatus);
+    std::lock_guard<std::mutex> lock(typeCacheMutex);
+    typeCache.erase(classId);
     return S_OK;
 }
 
@@ -269,13 +276,13 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITInlining(FunctionID callerId, Function
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ThreadCreated(ThreadID threadId)
 {
-    UNUSED(threadId);
+    vsharp::threadCreated(threadId);
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ThreadDestroyed(ThreadID threadId)
 {
-    UNUSED(threadId);
+    vsharp::threadDestroyed(threadId);
     return S_OK;
 }
 
@@ -283,6 +290,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ThreadAssignedToOSThread(ThreadID managed
 {
     UNUSED(managedThreadId);
     UNUSED(osThreadId);
+    vsharp::threadAssignedToOSThread();
     return S_OK;
 }
 
@@ -544,12 +552,16 @@ void CorProfiler::serializeType(const std::vector<bool> &isValid, const std::vec
     type = begin;
 }
 
-HRESULT STDMETHODCALLTYPE CorProfiler::ObjectAllocated(ObjectID objectId, ClassID classId)
+SerializedType CorProfiler::getSerializedType(ClassID classId)
 {
-    ULONG size;
-    this->corProfilerInfo->GetObjectSize(objectId, &size);
+    {
+        std::lock_guard<std::mutex> lock(typeCacheMutex);
+        auto cached = typeCache.find(classId);
+        if (cached != typeCache.end())
+            return cached->second;
+    }
 
-    char *type = new char[0];
+    char *type;
     unsigned long typeLength = 0;
 
     std::vector<bool> isValid;
@@ -564,7 +576,18 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ObjectAllocated(ObjectID objectId, ClassI
     resolveType(classId, isValid, isArray, arrayTypes, tokens, typeArgsCount, moduleNames, nameLengths, assemblyNames, assemblySizes);
     serializeType(isValid, isArray, arrayTypes, tokens, typeArgsCount, moduleNames, nameLengths, type, typeLength, assemblyNames, assemblySizes);
 
-    heap.allocateObject(objectId, size, type, typeLength);
+    std::lock_guard<std::mutex> lock(typeCacheMutex);
+    SerializedType result = std::make_shared<const SerializedTypeInfo>(SerializedTypeInfo{nextTypeId++, std::vector<char>(type, type + typeLength)});
+    delete[] type;
+    typeCache[classId] = result;
+    return result;
+}
+
+HRESULT STDMETHODCALLTYPE CorProfiler::ObjectAllocated(ObjectID objectId, ClassID classId)
+{
+    ULONG size;
+    this->corProfilerInfo->GetObjectSize(objectId, &size);
+    heap.allocateObject(objectId, size, getSerializedType(classId));
     return S_OK;
 }
 
@@ -2,6 +2,8 @@
 #define CORPROFILER_H_
 
 #include <atomic>
+#include <map>
+#include <mutex>
 #include "memory/heap.h"
 #include "cor.h"
 #include "corprof.h"
@@ -19,6 +21,11 @@ private:
     Instrumenter *instrumenter;
     Protocol *protocol;
 
+    // types of allocated objects are resolved once per class; ClassIDs may be reused after unloading
+    std::map<ClassID, SerializedType> typeCache;
+    unsigned nextTypeId = 0;
+    SerializedType getSerializedType(ClassID classId);
+
     void resolveType(ClassID classId, std::vector<bool> &isValid, std::vector<bool> &isArray, std::vector<std::pair<CorElementType, int>> &arrayTypes, std::vector<mdTypeDef> &tokens, std::vector<int> &typeArgsCount, std::vector<WCHAR> &moduleNames, std::vector<int> &moduleSizes, std::vector<WCHAR> &assemblyNames, std::vector<int> &assemblySizes);
     void serializeType(const std::vector<bool> &isValid, const std::vector<bool> &isArray, const std::vector<std::pair<CorElementType, int>> &arrayTypes, const std::vector<mdTypeDef> &tokens, const std::vector<int> &typeArgsCount, const std::vector<WCHAR> &moduleNames, const std::vector<int> &moduleSizes, char *&type, unsigned long &typeLength, const std::vector<WCHAR>& assemblyNames, const std::vector<int>& assemblySizes);
 
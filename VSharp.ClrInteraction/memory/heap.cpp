@@ -18,7 +18,7 @@ namespace vsharp {
 // --------------------------- Interval ---------------------------
 
     Interval::Interval()
-        : left(0), right(0), marked(false), flushed(false) { }
+        : left(0), right(0), flushed(false) { }
 
     Interval::Interval(ADDR leftValue, SIZE size)
         : Interval()
@@ -59,20 +59,6 @@ namespace vsharp {
         return "[" + std::to_string(left) + " ... " + std::to_string(right) + "]";
     }
 
-    void Interval::mark() {
-        assert(!marked);
-        marked = true;
-    }
-
-    void Interval::unmark() {
-        assert(marked);
-        marked = false;
-    }
-
-    bool Interval::isMarked() const {
-        return marked;
-    }
-
     void Interval::flush() {
         assert(!flushed);
         flushed = true;
@@ -156,11 +142,11 @@ namespace vsharp {
 
     Heap::Heap() = default;
 
-    OBJID Heap::allocateObject(ADDR address, SIZE size, char *type, unsigned long typeLength) {
+    OBJID Heap::allocateObject(ADDR address, SIZE size, const SerializedType &type) {
         auto *obj = new Object(address, size);
         tree.add(*obj);
         auto id = (OBJID) obj;
-        newAddresses[id] = std::make_pair(type, typeLength);
+        newAddresses[id] = type;
         return id;
     }
 
@@ -205,18 +191,26 @@ namespace vsharp {
     }
 
     void Heap::clearAfterGC() {
-        auto deleted = tree.clearUnmarked();
+        GCPassStatistics statistics;
+        auto deleted = tree.clearUnmarked(statistics);
         for (Interval *address : deleted)
             deletedAddresses.push_back((OBJID) address);
+
+        gcCount++;
+        gcTotals.ranges += statistics.ranges;
+        gcTotals.visited += statistics.visited;
+        gcTotals.moved += statistics.moved;
+        gcTotals.deleted += statistics.deleted;
+        LOG(tout << "GC #" << gcCount << ": " << statistics.ranges << " ranges, " << statistics.visited
+                 << " objects visited, " << statistics.moved << " moved, " << statistics.deleted << " deleted; total "
+                 << gcTotals.visited << " visited, " << gcTotals.moved << " moved, " << gcTotals.deleted << " deleted");
     }
 
     // TODO: store new addresses or get them from tree? #do
-    std::map<OBJID, std::pair<char*, unsigned long>> Heap::flushObjects() {
+    std::map<OBJID, SerializedType> Heap::flushObjects() {
 //        return tree.flush();
-        std::map<OBJID, std::pair<char*, unsigned long>> result;
-        for (const auto &address : newAddresses)
-            result[address.first] = address.second;
-        newAddresses.clear();
+        std::map<OBJID, SerializedType> result;
+        result.swap(newAddresses);
         return result;
     }
 
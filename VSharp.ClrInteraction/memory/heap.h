@@ -2,6 +2,7 @@
 #define HEAP_H_
 
 #include <map>
+#include <memory>
 #include <vector>
 #include "intervalTree.h"
 #include "cor.h"
@@ -23,7 +24,6 @@ public:
 
 class Interval {
 private:
-    bool marked;
     bool flushed;
 public:
     ADDR left;
@@ -45,10 +45,7 @@ public:
 
     virtual std::string toString() const;
 
-    // TODO: move 'marked' and 'flushed' fields to Object class; traverse objects in heap class, instead of IntervalTree
-    void mark();
-    void unmark();
-    bool isMarked() const;
+    // TODO: move 'flushed' field to Object class; traverse objects in heap class, instead of IntervalTree
     void flush();
     bool isFlushed() const;
 
@@ -73,6 +70,14 @@ public:
 
 typedef IntervalTree<Interval, Shift, ADDR> Intervals;
 
+// Serialized type of allocated objects, shared by all objects of one class; 'id' references the type on the wire
+struct SerializedTypeInfo {
+    unsigned id;
+    std::vector<char> bytes;
+};
+
+typedef std::shared_ptr<const SerializedTypeInfo> SerializedType;
+
 struct VirtualAddress
 {
     OBJID obj;
@@ -83,21 +88,23 @@ class Heap {
 private:
     Intervals tree;
     // TODO: store new addresses or get them from tree? #do
-    std::map<OBJID, std::pair<char*, unsigned long>> newAddresses;
+    std::map<OBJID, SerializedType> newAddresses;
     std::vector<OBJID> deletedAddresses;
+    size_t gcCount = 0;
+    GCPassStatistics gcTotals;
 
     bool resolve(ADDR address, VirtualAddress &vAddress) const;
 
 public:
     Heap();
 
-    OBJID allocateObject(ADDR address, SIZE size, char *type, unsigned long typeLength);
+    OBJID allocateObject(ADDR address, SIZE size, const SerializedType &type);
 
     void moveAndMark(ADDR oldLeft, ADDR newLeft, SIZE length);
     void markSurvivedObjects(ADDR start, SIZE length);
     void clearAfterGC();
 
-    std::map<OBJID, std::pair<char*, unsigned long>> flushObjects();
+    std::map<OBJID, SerializedType> flushObjects();
 
     VirtualAddress physToVirtAddress(ADDR physAddress) const;
     static ADDR virtToPhysAddress(const VirtualAddress &virtAddress);
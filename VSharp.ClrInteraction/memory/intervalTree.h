@@ -2,58 +2,95 @@
 #define INTERVALTREE_H_
 
 #include "../logging.h"
+#include <algorithm>
 #include <cassert>
+#include <vector>
 
+// Work done by one GC pass over the intervals
+struct GCPassStatistics {
+    size_t ranges = 0;
+    size_t visited = 0;
+    size_t moved = 0;
+    size_t deleted = 0;
+};
+
+// Non-overlapping intervals sorted by their left bounds, so points are resolved by binary search
 template<typename Interval, typename Shift, typename Point>
 class IntervalTree {
 private:
+    struct GCRange {
+        Interval range;
+        Shift shift;
+        bool moved;
+    };
+
     std::vector<Interval *> objects;
+    // ranges reported by the GC callbacks are applied at once, when the GC is finished
+    std::vector<GCRange> gcRanges;
+
+    typename std::vector<Interval *>::iterator firstFrom(const Point &p) {
+        return std::lower_bound(objects.begin(), objects.end(), p,
+                                [](const Interval *obj, const Point &point) { return obj->left < point; });
+    }
 public:
     void add(Interval &node) {
-        objects.push_back(&node);
+        // objects are mostly allocated at increasing addresses, so insertion is usually an append
+        if (objects.empty() || objects.back()->left < node.left)
+            objects.push_back(&node);
+        else
+            objects.insert(firstFrom(node.left), &node);
     }
 
     const Interval *find(const Point &p) const {
-        for (const Interval *obj : objects) {
-            if (obj->contains(p))
-                return obj;
-        }
+        auto it = std::upper_bound(objects.begin(), objects.end(), p,
+                                   [](const Point &point, const Interval *obj) { return point < obj->left; });
+        if (it != objects.begin() && (*(it - 1))->contains(p))
+            return *(it - 1);
         FAIL_LOUD("Unbound pointer!");
     }
 
     void moveAndMark(const Interval &interval, const Shift &shift) {
-        for (Interval *obj : objects) {
-            if (interval.includes(*obj)) {
-                obj->move(shift);
-                obj->mark();
-            } else {
-                assert(!interval.intersects(*obj));
-            }
-        }
+        gcRanges.push_back({interval, shift, true});
     }
 
     void mark(const Interval &interval) {
-        for (Interval *obj : objects) {
-            if (interval.includes(*obj))
-                obj->mark();
-            else
-                assert(!interval.intersects(*obj));
-        }
+        gcRanges.push_back({interval, Shift(), false});
     }
 
-    // TODO: copy all marked and clear or remove unmarked one by one?
-    std::vector<Interval *> clearUnmarked() {
-        std::vector<Interval *> marked;
+    // Merge-joins the sorted GC ranges with the sorted intervals: intervals included in some range survive
+    // (and are moved, if the range was moved), the rest are deleted; then the index is re-sorted by new addresses
+    std::vector<Interval *> clearUnmarked(GCPassStatistics &statistics) {
+        std::sort(gcRanges.begin(), gcRanges.end(),
+                  [](const GCRange &x, const GCRange &y) { return x.range.left < y.range.left; });
+        statistics.ranges = gcRanges.size();
+        statistics.visited = objects.size();
+
         std::vector<Interval *> unmarked;
-        for (Interval *obj : objects)
-            if (obj->isMarked()) {
-                obj->unmark();
-                marked.push_back(obj);
+        auto range = gcRanges.begin();
+        size_t survived = 0;
+        for (Interval *obj : objects) {
+            while (range != gcRanges.end() && range->range.right < obj->left)
+                ++range;
+            if (range != gcRanges.end() && range->range.includes(*obj)) {
+                if (range->moved) {
+                    obj->move(range->shift);
+                    statistics.moved++;
+                }
+                objects[survived++] = obj;
             } else {
+                assert(range == gcRanges.end() || !range->range.intersects(*obj));
                 unmarked.push_back(obj);
-                delete obj;
             }
-        objects = marked;
+        }
+        objects.resize(survived);
+        for (Interval *obj : unmarked)
+            delete obj;
+        statistics.deleted = unmarked.size();
+
+        if (statistics.moved > 0)
+            std::sort(objects.begin(), objects.end(),
+                      [](const Interval *x, const Interval *y) { return x->left < y->left; });
+        gcRanges.clear();
         return unmarked;
     }
 
@@ -1,5 +1,6 @@
 #include "memory.h"
 #include "stack.h"
+#include <atomic>
 #include <mutex>
 
 using namespace vsharp;
@@ -12,36 +13,85 @@ std::function<ThreadID()> vsharp::currentThread(&currentThreadNotConfigured);
 
 Heap vsharp::heap = Heap();
 
+std::mutex vsharp::typeCacheMutex;
+
 #ifdef _DEBUG
 std::map<unsigned, const char*> vsharp::stringsPool;
 int topStringIndex = 0;
 #endif
 
-ThreadID lastThreadID = 0;
-Stack *currentStack = nullptr;
+// Stacks of all live managed threads; touched only when threads are created or destroyed
+std::map<ThreadID, Stack *> stacks;
+std::mutex stacksMutex;
+
+// The stack of the executing thread, so probes do not query the profiler API on every call
+struct CachedStack {
+    Stack *stack;
+    unsigned generation;
+};
+
+// Bumped whenever a cached stack may become wrong: a stack is freed or a managed thread moves to another OS thread.
+// Generation 0 is never used, so a fresh thread always misses the cache
+static std::atomic<unsigned> stacksGeneration(1);
+thread_local CachedStack currentStack = {nullptr, 0};
+
+static void invalidateStackCaches() {
+    unsigned generation = stacksGeneration.fetch_add(1, std::memory_order_acq_rel) + 1;
+    if (generation == 0) {
+        // skipping the generation reserved for uninitialized caches
+        stacksGeneration.fetch_add(1, std::memory_order_acq_rel);
+    }
+}
+
+static Stack *registerStack(ThreadID tid) {
+    std::lock_guard<std::mutex> lock(stacksMutex);
+    Stack *&s = stacks[tid];
+    if (!s) s = new Stack();
+    return s;
+}
 
-inline void switchContext() {
-    ThreadID tid = currentThread();
-    if (tid != lastThreadID) {
-        lastThreadID = tid;
-        Stack *&s = stacks[tid];
-        if (!s) s = new Stack();
-        currentStack = s;
+void vsharp::threadCreated(ThreadID tid) {
+    registerStack(tid);
+}
+
+void vsharp::threadDestroyed(ThreadID tid) {
+    Stack *s = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(stacksMutex);
+        auto it = stacks.find(tid);
+        if (it == stacks.end()) return;
+        s = it->second;
+        stacks.erase(it);
     }
+    // NOTE: the callback may come from another thread, so the cache of the dying OS thread may still point to the stack;
+    //       it is invalidated before the stack is freed, so the pointer is never used again
+    invalidateStackCaches();
+    delete s;
+}
+
+void vsharp::threadAssignedToOSThread() {
+    invalidateStackCaches();
+}
+
+static inline Stack *ownStack() {
+    // ThreadCreated is not guaranteed to come on the new thread, so the cache is filled on the first probe
+    unsigned generation = stacksGeneration.load(std::memory_order_acquire);
+    if (currentStack.generation != generation)
+        currentStack = {registerStack(currentThread()), generation};
+    return currentStack.stack;
 }
 
 Stack &vsharp::stack() {
-    switchContext();
-    return *currentStack;
+    return *ownStack();
 }
 
 StackFrame &vsharp::topFrame() {
-    switchContext();
-    return currentStack->topFrame();
+    return ownStack()->topFrame();
 }
 
 void vsharp::validateStackEmptyness() {
 #ifdef _DEBUG
+    std::lock_guard<std::mutex> lock(stacksMutex);
     for (auto &kv : stacks) {
         if (!kv.second->isEmpty()) {
             FAIL_LOUD("Stack is not empty after program termination!!");
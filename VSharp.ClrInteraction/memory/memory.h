@@ -6,18 +6,26 @@
 #include "heap.h"
 #include <functional>
 #include <map>
+#include <mutex>
 
 typedef UINT_PTR ThreadID;
 
 namespace vsharp {
 
 extern std::function<ThreadID()> currentThread;
-static std::map<ThreadID, Stack *> stacks;
 extern Heap heap;
+// guards the cache of serialized types of the profiler and the set of types already defined to the client
+extern std::mutex typeCacheMutex;
 #ifdef _DEBUG
 extern std::map<unsigned, const char*> stringsPool;
 #endif
 
+// Registers and releases the stack of a managed thread
+void threadCreated(ThreadID tid);
+void threadDestroyed(ThreadID tid);
+// the managed thread of some OS thread has changed, so the cached stacks are dropped
+void threadAssignedToOSThread();
+
 Stack &stack();
 StackFrame &topFrame();
 
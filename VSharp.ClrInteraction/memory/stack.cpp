@@ -1,5 +1,6 @@
 #include "stack.h"
 #include "../logging.h"
+#include <algorithm>
 #include <cstring>
 #include <cassert>
 
@@ -7,33 +8,83 @@ using namespace vsharp;
 
 #define CONCRETE UINT32_MAX
 
-StackFrame::StackFrame(unsigned resolvedToken, unsigned unresolvedToken, const bool *args, unsigned argsCount)
-    : m_concreteness(nullptr)
+char *FrameArena::allocateBytes(size_t size, size_t alignment)
+{
+    size_t start = (m_used + alignment - 1) & ~(alignment - 1);
+    if (m_block < m_blocks.size() && start + size <= m_blocks[m_block].size) {
+        m_used = start + size;
+        return m_blocks[m_block].data.get() + start;
+    }
+
+    static const size_t minBlockSize = 16 * 1024;
+    size_t next = m_blocks.empty() ? 0 : m_block + 1;
+    if (next == m_blocks.size() || m_blocks[next].size < size) {
+        size_t blockSize = std::max(size, m_blocks.empty() ? minBlockSize : 2 * m_blocks.back().size);
+        // the blocks after the current one are free, so a too small one is replaced
+        if (next == m_blocks.size())
+            m_blocks.push_back({std::unique_ptr<char[]>(new char[blockSize]), blockSize});
+        else
+            m_blocks[next] = {std::unique_ptr<char[]>(new char[blockSize]), blockSize};
+    }
+    m_block = next;
+    m_used = size;
+    return m_blocks[m_block].data.get();
+}
+
+FrameArena::Mark FrameArena::mark() const
+{
+    return {m_block, m_used};
+}
+
+void FrameArena::release(const Mark &mark)
+{
+    m_block = mark.block;
+    m_used = mark.used;
+}
+
+StackFrame::StackFrame()
+    : m_arenaMark({0, 0})
+    , m_concreteness(nullptr)
     , m_capacity(0)
     , m_concretenessTop(0)
     , m_symbolsCount(0)
-    , m_args(new bool[argsCount])
+    , m_args(nullptr)
     , m_locals(nullptr)
-    , m_resolvedToken(resolvedToken)
-    , m_unresolvedToken(unresolvedToken)
+    , m_resolvedToken(0)
+    , m_unresolvedToken(0)
     , m_enteredMarker(false)
     , m_spontaneous(false)
 {
-    memcpy(m_args, args, argsCount);
     resetPopsTracking();
 }
 
-StackFrame::~StackFrame()
+void StackFrame::init(unsigned resolvedToken, unsigned unresolvedToken, bool *args, const FrameArena::Mark &arenaMark)
 {
-    delete [] m_concreteness;
+    m_arenaMark = arenaMark;
+    m_concreteness = nullptr;
+    m_capacity = 0;
+    m_concretenessTop = 0;
+    m_symbolsCount = 0;
+    m_args = args;
+    m_locals = nullptr;
+    m_resolvedToken = resolvedToken;
+    m_unresolvedToken = unresolvedToken;
+    m_enteredMarker = false;
+    m_spontaneous = false;
+    m_lastPoppedSymbolics.clear();
+    resetPopsTracking();
 }
 
-void StackFrame::configure(unsigned maxStackSize, unsigned localsCount)
+void StackFrame::configure(unsigned *concreteness, unsigned maxStackSize, bool *locals)
 {
     m_capacity = maxStackSize;
-    m_concreteness = new unsigned[maxStackSize];
-    m_locals = new bool[localsCount];
-    memset(m_locals, true, localsCount);
+    m_concreteness = concreteness;
+    m_locals = locals;
+}
+
+const FrameArena::Mark &StackFrame::arenaMark() const
+{
+    return m_arenaMark;
 }
 
 bool StackFrame::isEmpty() const
@@ -222,60 +273,78 @@ const std::vector<std::pair<unsigned, unsigned>> &StackFrame::poppedSymbolics()
     return m_lastPoppedSymbolics;
 }
 
-void Stack::pushFrame(unsigned resolvedToken, unsigned unresolvedToken, const bool *args, unsigned argsCount)
+StackFrame &Stack::pushFrame(unsigned resolvedToken, unsigned unresolvedToken, unsigned argsCount, bool argsConcreteness)
 {
-    m_frames.push_back(StackFrame(resolvedToken, unresolvedToken, args, argsCount));
+    FrameArena::Mark mark = m_arena.mark();
+    bool *args = m_arena.allocate<bool>(argsCount);
+    memset(args, argsConcreteness, argsCount);
+    if (m_top == m_frames.size())
+        m_frames.emplace_back();
+    StackFrame &frame = m_frames[m_top++];
+    frame.init(resolvedToken, unresolvedToken, args, mark);
+    return frame;
 }
 
+void Stack::configureTopFrame(unsigned maxStackSize, unsigned localsCount)
+{
+    // NOTE: the top frame owns the end of the arena, so its arrays are released together with its arguments
+    StackFrame &frame = topFrame();
+    auto concreteness = m_arena.allocate<unsigned>(maxStackSize);
+    auto locals = m_arena.allocate<bool>(localsCount);
+    memset(locals, true, localsCount);
+    frame.configure(concreteness, maxStackSize, locals);
+}
 
 void Stack::popFrame()
 {
     popFrameUntracked();
-    if (m_frames.size() < m_minTopSinceLastSent) {
-        m_minTopSinceLastSent = m_frames.size();
+    if (m_top < m_minTopSinceLastSent) {
+        m_minTopSinceLastSent = m_top;
     }
 }
 
 void Stack::popFrameUntracked()
 {
 #ifdef _DEBUG
-    if (m_frames.empty()) {
+    if (m_top == 0) {
         FAIL_LOUD("Stack is empty! Can't pop frame!");
-    } else if (!m_frames.back().isEmpty()) {
+    } else if (!m_frames[m_top - 1].isEmpty()) {
         FAIL_LOUD("Corrupted stack: opstack is not empty when popping frame!");
     }
 #endif
-    m_frames.pop_back();
+    // NOTE: the popped frame stays valid until the next push, the probes rely on it
+    --m_top;
+    m_arena.release(m_frames[m_top].arenaMark());
 }
 
 StackFrame &Stack::topFrame()
 {
 #ifdef _DEBUG
-    if (m_frames.empty()) {
+    if (m_top == 0) {
         FAIL_LOUD("Requesting top frame of empty stack!");
     }
 #endif
-    return m_frames.back();
+    return m_frames[m_top - 1];
 }
 
 const StackFrame &Stack::topFrame() const
 {
 #ifdef _DEBUG
-    if (m_frames.empty()) {
+    if (m_top == 0) {
         FAIL_LOUD("Requesting top frame of empty stack!");
     }
 #endif
-    return m_frames.back();
+    return m_frames[m_top - 1];
 }
 
 bool Stack::isEmpty() const
 {
-    return m_frames.empty();
+    return m_top == 0;
 }
 
 unsigned Stack::framesCount() const
 {
-    return m_frames.size();
+    return m_top;
 }
 
 unsigned Stack::tokenAt(unsigned index) const
@@ -296,8 +365,8 @@ unsigned Stack::minTopSinceLastSent() const
 void Stack::resetPopsTracking(int framesCount)
 {
     m_lastSentTop = framesCount;
-    m_minTopSinceLastSent = m_frames.size();
-    if (!m_frames.empty()) {
-        m_frames.back().resetPopsTracking();
+    m_minTopSinceLastSent = m_top;
+    if (m_top > 0) {
+        m_frames[m_top - 1].resetPopsTracking();
     }
 }
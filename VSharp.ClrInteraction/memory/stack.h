@@ -1,13 +1,46 @@
 #ifndef STACK_H_
 #define STACK_H_
 
+#include <cstddef>
+#include <memory>
 #include <vector>
-#include <stack>
 
 namespace vsharp {
 
+// Bump allocator for the arrays of the frames: they are released in LIFO order together with the frames,
+// and the blocks are kept, so steady-state calls do not touch the system allocator
+class FrameArena {
+public:
+    struct Mark {
+        size_t block;
+        size_t used;
+    };
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> m_blocks;
+    size_t m_block = 0;
+    size_t m_used = 0;
+
+    char *allocateBytes(size_t size, size_t alignment);
+
+public:
+    Mark mark() const;
+    void release(const Mark &mark);
+
+    template<typename T>
+    T *allocate(unsigned count) {
+        return reinterpret_cast<T *>(allocateBytes(count * sizeof(T), alignof(T)));
+    }
+};
+
 class StackFrame {
 private:
+    FrameArena::Mark m_arenaMark;
     unsigned *m_concreteness;
     unsigned m_capacity;
     unsigned m_concretenessTop;
@@ -27,10 +60,12 @@ private:
     std::vector<std::pair<unsigned, unsigned>> m_lastPoppedSymbolics;
 
 public:
-    StackFrame(unsigned resolvedToken, unsigned unresolvedToken, const bool *args, unsigned argsCount);
-    ~StackFrame();
+    StackFrame();
 
-    void configure(unsigned maxStackSize, unsigned localsCount);
+    // Frames are reused by the stack, so they are initialized on push instead of construction
+    void init(unsigned resolvedToken, unsigned unresolvedToken, bool *args, const FrameArena::Mark &arenaMark);
+    void configure(unsigned *concreteness, unsigned maxStackSize, bool *locals);
+    const FrameArena::Mark &arenaMark() const;
 
     inline bool isEmpty() const;
     inline bool isFull() const;
@@ -72,12 +107,17 @@ public:
 
 class Stack {
 private:
-    std::deque<StackFrame> m_frames;
+    // frames above m_top are popped, but kept to be reused by the next pushes
+    std::vector<StackFrame> m_frames;
+    unsigned m_top = 0;
+    FrameArena m_arena;
     unsigned m_lastSentTop;
     unsigned m_minTopSinceLastSent;
 
 public:
-    void pushFrame(unsigned resolvedToken, unsigned unresolvedToken, const bool *args, unsigned argsCount);
+    // All arguments get the concreteness 'argsConcreteness', the caller then refines them with 'setArg'
+    StackFrame &pushFrame(unsigned resolvedToken, unsigned unresolvedToken, unsigned argsCount, bool argsConcreteness);
+    void configureTopFrame(unsigned maxStackSize, unsigned localsCount);
     void popFrame();
     void popFrameUntracked();
     StackFrame &topFrame();
@@ -75,25 +75,40 @@ struct ExecCommand {
     unsigned evaluationStackPushesCount;
     unsigned evaluationStackPops;
     unsigned newAddressesCount;
+    unsigned newTypesCount;
+    // protocol v1 clients expect the full type of every new address, type ids are sent only by protocol v2
+    bool internTypes;
     unsigned *newCallStackFrames;
     EvalStackOperand *evaluationStackPushes;
     // TODO: add deleted addresses
     OBJID *newAddresses;
-    unsigned long *newAddressesTypeLengths;
-    char *newAddressesTypes;
-
-    void serialize(char *&bytes, unsigned &count) const {
-        count = 7 * sizeof(unsigned) + sizeof(unsigned) * newCallStackFramesCount;
+    // types of new addresses are referenced by ids; each type is defined once, in the first command referencing it;
+    // without interning, lengths and bytes of the types are given for every new address instead
+    unsigned *newAddressesTypeIds;
+    unsigned *newTypesIds;
+    unsigned long *newTypesLengths;
+    char *newTypes;
+
+    // Layout v2: 8 header counters, call stack frames, evaluation stack pushes, new addresses, their type ids,
+    // then ids, lengths and serialized bytes of the types defined by this command
+    // Layout v1: 7 header counters, call stack frames, evaluation stack pushes, new addresses,
+    // then lengths and serialized bytes of their types
+    void serialize(std::vector<char> &bytes) const {
+        unsigned headerCount = internTypes ? 8 : 7;
+        unsigned count = headerCount * sizeof(unsigned) + sizeof(unsigned) * newCallStackFramesCount;
         for (unsigned i = 0; i < evaluationStackPushesCount; ++i)
             count += evaluationStackPushes[i].size();
         count += sizeof(UINT_PTR) * newAddressesCount;
-        count += newAddressesCount * sizeof(unsigned long);
+        if (internTypes)
+            count += newAddressesCount * sizeof(unsigned) + newTypesCount * sizeof(unsigned);
+        count += newTypesCount * sizeof(unsigned long);
         unsigned long fullTypesSize = 0;
-        for (int i = 0; i < newAddressesCount; ++i)
-            fullTypesSize += newAddressesTypeLengths[i];
+        for (unsigned i = 0; i < newTypesCount; ++i)
+            fullTypesSize += newTypesLengths[i];
         count += fullTypesSize;
-        bytes = new char[count];
-        char *buffer = bytes;
+        // the buffer is reused by the commands of the thread, so it grows only for the biggest command
+        bytes.resize(count);
+        char *buffer = bytes.data();
         unsigned size = sizeof(unsigned);
         *(unsigned *)buffer = offset; buffer += size;
         *(unsigned *)buffer = isBranch; buffer += size;
@@ -102,6 +117,9 @@ struct ExecCommand {
         *(unsigned *)buffer = evaluationStackPushesCount; buffer += size;
         *(unsigned *)buffer = evaluationStackPops; buffer += size;
         *(unsigned *)buffer = newAddressesCount; buffer += size;
+        if (internTypes) {
+            *(unsigned *)buffer = newTypesCount; buffer += size;
+        }
         size = newCallStackFramesCount * sizeof(unsigned);
         memcpy(buffer, (char*)newCallStackFrames, size); buffer += size;
         for (unsigned i = 0; i < evaluationStackPushesCount; ++i) {
@@ -109,12 +127,37 @@ struct ExecCommand {
         }
         size = newAddressesCount * sizeof(UINT_PTR);
         memcpy(buffer, (char*)newAddresses, size); buffer += size;
-        size = newAddressesCount * sizeof(unsigned long);
-        memcpy(buffer, (char*)newAddressesTypeLengths, size); buffer += size;
-        memcpy(buffer, newAddressesTypes, fullTypesSize); buffer += fullTypesSize;
+        if (internTypes) {
+            size = newAddressesCount * sizeof(unsigned);
+            memcpy(buffer, (char*)newAddressesTypeIds, size); buffer += size;
+            size = newTypesCount * sizeof(unsigned);
+            memcpy(buffer, (char*)newTypesIds, size); buffer += size;
+        }
+        size = newTypesCount * sizeof(unsigned long);
+        memcpy(buffer, (char*)newTypesLengths, size); buffer += size;
+        memcpy(buffer, newTypes, fullTypesSize); buffer += fullTypesSize;
     }
 };
 
+// ids of the types, which were already defined to the client; guarded by 'typeCacheMutex'
+std::vector<bool> sentTypes;
+
+// Arrays of the commands, reused by all commands of the thread, so steady concolic steps do not allocate
+struct CommandScratch {
+    std::vector<unsigned> newCallStackFrames;
+    std::vector<OBJID> newAddresses;
+    std::vector<unsigned> newAddressesTypeIds;
+    std::vector<unsigned> newTypesIds;
+    std::vector<unsigned long> newTypesLengths;
+    std::vector<char> newTypes;
+    std::vector<char> serialized;
+    std::vector<char> response;
+    std::vector<EvalStackOperand> callOperands;
+    std::vector<unsigned> symbolicArgs;
+};
+
+thread_local CommandScratch commandScratch;
+
 void initCommand(OFFSET offset, bool isBranch, unsigned opsCount, EvalStackOperand *ops, ExecCommand &command) {
     Stack &stack = vsharp::stack();
     StackFrame &top = stack.topFrame();
@@ -125,10 +168,12 @@ void initCommand(OFFSET offset, bool isBranch, unsigned opsCount, EvalStackOpera
     unsigned currCallFrames = stack.framesCount();
     assert(minCallFrames <= currCallFrames);
     command.newCallStackFramesCount = currCallFrames - minCallFrames;
-    command.newCallStackFrames = new unsigned[command.newCallStackFramesCount];
+    auto &frames = commandScratch.newCallStackFrames;
+    frames.clear();
     for (unsigned i = minCallFrames; i < currCallFrames; ++i) {
-        command.newCallStackFrames[i - minCallFrames] = stack.tokenAt(i);
+        frames.push_back(stack.tokenAt(i));
     }
+    command.newCallStackFrames = frames.data();
 
     command.callStackFramesPops = stack.unsentPops();
     unsigned afterPop = top.symbolicsCount();
@@ -145,32 +190,53 @@ void initCommand(OFFSET offset, bool isBranch, unsigned opsCount, EvalStackOpera
     command.evaluationStackPops = top.evaluationStackPops();
     command.evaluationStackPushes = ops;
     auto newAddresses = heap.flushObjects();
-    auto addressesSize = newAddresses.size();
-    command.newAddressesCount = addressesSize;
-    command.newAddresses = new UINT_PTR[addressesSize];
-    unsigned long fullTypesSize = 0;
-    for (const auto &newAddress : newAddresses)
-        fullTypesSize += newAddress.second.second;
-    command.newAddressesTypes = new char[fullTypesSize];
-    command.newAddressesTypeLengths = new unsigned long[addressesSize];
-    auto begin = command.newAddressesTypes;
-    int i = 0;
-    for (const auto &newAddress : newAddresses) {
-        command.newAddresses[i] = newAddress.first;
-        auto pair = newAddress.second;
-        auto typeSize = pair.second;
-        command.newAddressesTypeLengths[i] = typeSize;
-        if (typeSize != 0) memcpy(command.newAddressesTypes, pair.first, typeSize);
-        command.newAddressesTypes += typeSize;
-        delete pair.first;
-        i++;
+    auto &addresses = commandScratch.newAddresses;
+    auto &typeIds = commandScratch.newAddressesTypeIds;
+    auto &newTypesIds = commandScratch.newTypesIds;
+    auto &newTypesLengths = commandScratch.newTypesLengths;
+    auto &newTypes = commandScratch.newTypes;
+    addresses.clear();
+    typeIds.clear();
+    newTypesIds.clear();
+    newTypesLengths.clear();
+    newTypes.clear();
+    command.internTypes = protocol->version() == ProtocolV2;
+    if (command.internTypes) {
+        std::lock_guard<std::mutex> lock(typeCacheMutex);
+        for (const auto &newAddress : newAddresses) {
+            const auto &type = *newAddress.second;
+            addresses.push_back(newAddress.first);
+            typeIds.push_back(type.id);
+            if (type.id >= sentTypes.size())
+                sentTypes.resize(type.id + 1, false);
+            if (!sentTypes[type.id]) {
+                sentTypes[type.id] = true;
+                newTypesIds.push_back(type.id);
+                newTypesLengths.push_back(type.bytes.size());
+                newTypes.insert(newTypes.end(), type.bytes.begin(), type.bytes.end());
+            }
+        }
+    } else {
+        for (const auto &newAddress : newAddresses) {
+            const auto &type = *newAddress.second;
+            addresses.push_back(newAddress.first);
+            newTypesLengths.push_back(type.bytes.size());
+            newTypes.insert(newTypes.end(), type.bytes.begin(), type.bytes.end());
+        }
     }
-    command.newAddressesTypes = begin;
+    command.newAddressesCount = addresses.size();
+    command.newAddresses = addresses.data();
+    command.newAddressesTypeIds = typeIds.data();
+    command.newTypesCount = newTypesLengths.size();
+    command.newTypesIds = newTypesIds.data();
+    command.newTypesLengths = newTypesLengths.data();
+    command.newTypes = newTypes.data();
 }
 
 bool readExecResponse(StackFrame &top, EvalStackOperand *ops, unsigned &count, int &framesCount, EvalStackOperand &result) {
-    char *bytes; int messageLength;
-    protocol->acceptExecResult(bytes, messageLength);
+    int messageLength;
+    protocol->acceptExecResult(commandScratch.response, messageLength);
+    char *bytes = commandScratch.response.data();
     char *start = bytes;
     framesCount = *(int*)bytes; bytes += sizeof(int);
     char lastPush = *(char*)bytes; bytes += sizeof(char);
@@ -196,18 +262,9 @@ bool readExecResponse(StackFrame &top, EvalStackOperand *ops, unsigned &count, i
     }
     assert(bytes - start == messageLength);
 
-    delete start;
     return opsConcretized;
 }
 
-void freeCommand(ExecCommand &command) {
-    delete[] command.newCallStackFrames;
-    delete[] command.evaluationStackPushes;
-    delete[] command.newAddresses;
-    delete[] command.newAddressesTypeLengths;
-    delete[] command.newAddressesTypes;
-}
-
 void updateMemory(EvalStackOperand &op, unsigned int idx) {
     switch (op.typ) {
         case OpI4:
@@ -232,7 +289,9 @@ void updateMemory(EvalStackOperand &op, unsigned int idx) {
 bool sendCommand(OFFSET offset, unsigned opsCount, EvalStackOperand *ops) {
     ExecCommand command;
     initCommand(offset, false, opsCount, ops, command);
-    protocol->sendSerializable(ExecuteCommand, command);
+    auto &serialized = commandScratch.serialized;
+    command.serialize(serialized);
+    protocol->writeCommandFrame(ExecuteCommand, serialized.data(), (int)serialized.size());
     StackFrame &top = vsharp::topFrame();
     int framesCount;
     EvalStackOperand internalCallResult = EvalStackOperand {OpSymbolic, 0};
@@ -252,12 +311,19 @@ bool sendCommand(OFFSET offset, unsigned opsCount, EvalStackOperand *ops) {
         updateMemory(internalCallResult, oldOpsCount);
 
     vsharp::stack().resetPopsTracking(framesCount);
-    freeCommand(command);
     return opsConcretized;
 }
 
+// operands of the probes with fixed arity are held inline in a temporary living until the end of the probe call
+const unsigned maxInlineOperands = 2;
+
+struct InlineOperands {
+    EvalStackOperand items[maxInlineOperands];
+    EvalStackOperand *data() { return items; }
+};
+
 bool sendCommand0(OFFSET offset) { return sendCommand(offset, 0, nullptr); }
-bool sendCommand1(OFFSET offset) { return sendCommand(offset, 1, new EvalStackOperand[1]); }
+bool sendCommand1(OFFSET offset) { return sendCommand(offset, 1, InlineOperands().data()); }
 
 // TODO:
 EvalStackOperand mkop_4(INT32 op) { return {OpI4, (long long)op}; }
@@ -283,7 +349,8 @@ EvalStackOperand mkop_p(INT_PTR op) {
 EvalStackOperand mkop_struct(INT_PTR op) { FAIL_LOUD("not implemented"); }
 
 EvalStackOperand* createOps(int opsCount) {
-    auto ops = new EvalStackOperand[opsCount];
+    commandScratch.callOperands.resize(opsCount);
+    auto ops = commandScratch.callOperands.data();
     for (int i = 0; i < opsCount; ++i) {
         CorElementType type = unmemType((INT8) i);
         switch (type) {
@@ -426,22 +493,22 @@ PROBE(COND, Track_BinOp, ()) {
         top.push1Concrete();
     return concreteness; }
 // TODO: do we need op?
-PROBE(void, Exec_BinOp_4, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_8, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_8(arg2) }); }
-PROBE(void, Exec_BinOp_f4, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f4(arg1), mkop_f4(arg2) }); }
-PROBE(void, Exec_BinOp_f8, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f8(arg1), mkop_f8(arg2) }); }
-PROBE(void, Exec_BinOp_p, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_8_4, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_4_p, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_p_4, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_4_ovf, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_8_ovf, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_8(arg2) }); }
-PROBE(void, Exec_BinOp_f4_ovf, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f4(arg1), mkop_f4(arg2) }); }
-PROBE(void, Exec_BinOp_f8_ovf, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f8(arg1), mkop_f8(arg2) }); }
-PROBE(void, Exec_BinOp_p_ovf, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_8_4_ovf, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_4_p_ovf, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_p_4_ovf, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_4(arg2) }); }
+PROBE(void, Exec_BinOp_4, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_4(arg1), mkop_4(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_8, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_8(arg1), mkop_8(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_f4, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_f4(arg1), mkop_f4(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_f8, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_f8(arg1), mkop_f8(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_p, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_p(arg1), mkop_p(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_8_4, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_8(arg1), mkop_4(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_4_p, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_4(arg1), mkop_p(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_p_4, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_p(arg1), mkop_4(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_4_ovf, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_4(arg1), mkop_4(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_8_ovf, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_8(arg1), mkop_8(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_f4_ovf, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_f4(arg1), mkop_f4(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_f8_ovf, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_f8(arg1), mkop_f8(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_p_ovf, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_p(arg1), mkop_p(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_8_4_ovf, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_8(arg1), mkop_4(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_4_p_ovf, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_4(arg1), mkop_p(arg2) }}.data()); }
+PROBE(void, Exec_BinOp_p_4_ovf, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_p(arg1), mkop_4(arg2) }}.data()); }
 
 PROBE(void, Track_Ldind, (INT_PTR ptr, OFFSET offset)) {
     // TODO
@@ -455,13 +522,13 @@ PROBE(COND, Track_Stind, (INT_PTR ptr, INT32 sizeOfPtr)) {
     return topFrame().pop(2);
 }
 
-PROBE(void, Exec_Stind_I1, (INT_PTR ptr, INT8 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) }); }
-PROBE(void, Exec_Stind_I2, (INT_PTR ptr, INT16 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) }); }
-PROBE(void, Exec_Stind_I4, (INT_PTR ptr, INT32 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) }); }
-PROBE(void, Exec_Stind_I8, (INT_PTR ptr, INT64 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_8(value) }); }
-PROBE(void, Exec_Stind_R4, (INT_PTR ptr, FLOAT value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f4(value) }); }
-PROBE(void, Exec_Stind_R8, (INT_PTR ptr, DOUBLE value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f8(value) }); }
-PROBE(void, Exec_Stind_ref, (INT_PTR ptr, INT_PTR value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_p(value) }); }
+PROBE(void, Exec_Stind_I1, (INT_PTR ptr, INT8 value, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_4(value) }}.data()); }
+PROBE(void, Exec_Stind_I2, (INT_PTR ptr, INT16 value, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_4(value) }}.data()); }
+PROBE(void, Exec_Stind_I4, (INT_PTR ptr, INT32 value, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_4(value) }}.data()); }
+PROBE(void, Exec_Stind_I8, (INT_PTR ptr, INT64 value, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_8(value) }}.data()); }
+PROBE(void, Exec_Stind_R4, (INT_PTR ptr, FLOAT value, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_f4(value) }}.data()); }
+PROBE(void, Exec_Stind_R8, (INT_PTR ptr, DOUBLE value, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_f8(value) }}.data()); }
+PROBE(void, Exec_Stind_ref, (INT_PTR ptr, INT_PTR value, OFFSET offset)) { sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_p(value) }}.data()); }
 
 inline void conv(OFFSET offset) {
     StackFrame &top = vsharp::topFrame();
@@ -529,7 +596,6 @@ PROBE(void, Exec_Initblk, (INT_PTR ptr, INT8 value, INT_PTR count, OFFSET offset
 PROBE(void, Track_Castclass, (INT_PTR ptr, mdToken typeToken, OFFSET offset)) {
     // TODO
     // TODO: if exn is thrown, no value is pushed onto the stack
-//    switchContext();
     // TODO: is it true that 'castclass' contains only pop,
     // because after 'castclass' JIT calls private function 'CastHelpers.ChkCastClass',
     // that pushes result?
@@ -557,7 +623,7 @@ inline bool ldfld(INT_PTR fieldPtr, INT32 fieldSize) {
 // TODO: if objPtr = null, it's static field
 PROBE(void, Track_Ldfld, (INT_PTR objPtr, INT32 fieldOffset, INT32 fieldSize, OFFSET offset)) {
     if (!ldfld(objPtr + fieldOffset, fieldSize)) {
-        sendCommand(offset, 1, new EvalStackOperand[1] { mkop_p(objPtr) });
+        sendCommand(offset, 1, InlineOperands{{ mkop_p(objPtr) }}.data());
     } else {
         vsharp::topFrame().push1Concrete();
     }
@@ -572,32 +638,32 @@ inline bool stfld(mdToken fieldToken, INT_PTR ptr) {
 
 PROBE(void, Track_Stfld_4, (mdToken fieldToken, INT_PTR ptr, INT32 value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) });
+        sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_4(value) }}.data());
     }
 }
 PROBE(void, Track_Stfld_8, (mdToken fieldToken, INT_PTR ptr, INT64 value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_8(value) });
+        sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_8(value) }}.data());
     }
 }
 PROBE(void, Track_Stfld_f4, (mdToken fieldToken, INT_PTR ptr, FLOAT value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f4(value) });
+        sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_f4(value) }}.data());
     }
 }
 PROBE(void, Track_Stfld_f8, (mdToken fieldToken, INT_PTR ptr, DOUBLE value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f8(value) });
+        sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_f8(value) }}.data());
     }
 }
 PROBE(void, Track_Stfld_p, (mdToken fieldToken, INT_PTR ptr, INT_PTR value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_p(value) });
+        sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_p(value) }}.data());
     }
 }
 PROBE(void, Track_Stfld_struct, (mdToken fieldToken, INT_PTR ptr, INT_PTR value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_struct(value) });
+        sendCommand(offset, 2, InlineOperands{{ mkop_p(ptr), mkop_struct(value) }}.data());
     }
 }
 /// TODO: stfld may be called with any value type! :(
@@ -667,24 +733,18 @@ PROBE(void, Track_Enter, (mdMethodDef token, unsigned maxStackSize, unsigned arg
     } else {
         LOG(tout << "Spontaneous enter! Details: expected token "
                  << HEX(expected) << ", but entered " << HEX(token) << std::endl);
-        auto args = new bool[argsCount];
-        memset(args, true, argsCount);
-        stack.pushFrame(token, token, args, argsCount);
-        top = &stack.topFrame();
+        top = &stack.pushFrame(token, token, argsCount, true);
         top->setSpontaneous(true);
-        delete[] args;
     }
     top->setEnteredMarker(true);
-    top->configure(maxStackSize, localsCount);
+    stack.configureTopFrame(maxStackSize, localsCount);
 }
 
 PROBE(void, Track_EnterMain, (mdMethodDef token, UINT16 argsCount, bool argsConcreteness, unsigned maxStackSize, unsigned localsCount)) {
     mainEntered();
     Stack &stack = vsharp::stack();
     assert(stack.isEmpty());
-    auto args = new bool[argsCount];
-    memset(args, argsConcreteness, argsCount);
-    stack.pushFrame(token, token, args, argsCount);
+    stack.pushFrame(token, token, argsCount, argsConcreteness);
     Track_Enter(token, maxStackSize, argsCount, localsCount);
     stack.resetPopsTracking(1);
 }
@@ -729,12 +789,12 @@ void leaveMain(OFFSET offset, UINT8 opsCount, EvalStackOperand *ops) {
     if (opsCount > 0) stack.topFrame().pop1();
     stack.popFrame();
 }
-PROBE(void, Track_LeaveMain_0, (OFFSET offset)) { leaveMain(offset, 0, new EvalStackOperand[0] { }); }
-PROBE(void, Track_LeaveMain_4, (INT32 returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_4(returnValue) }); }
-PROBE(void, Track_LeaveMain_8, (INT64 returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_8(returnValue) }); }
-PROBE(void, Track_LeaveMain_f4, (FLOAT returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_f4(returnValue) }); }
-PROBE(void, Track_LeaveMain_f8, (DOUBLE returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_f8(returnValue) }); }
-PROBE(void, Track_LeaveMain_p, (INT_PTR returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_p(returnValue) }); }
+PROBE(void, Track_LeaveMain_0, (OFFSET offset)) { leaveMain(offset, 0, InlineOperands().data()); }
+PROBE(void, Track_LeaveMain_4, (INT32 returnValue, OFFSET offset)) { leaveMain(offset, 1, InlineOperands{{ mkop_4(returnValue) }}.data()); }
+PROBE(void, Track_LeaveMain_8, (INT64 returnValue, OFFSET offset)) { leaveMain(offset, 1, InlineOperands{{ mkop_8(returnValue) }}.data()); }
+PROBE(void, Track_LeaveMain_f4, (FLOAT returnValue, OFFSET offset)) { leaveMain(offset, 1, InlineOperands{{ mkop_f4(returnValue) }}.data()); }
+PROBE(void, Track_LeaveMain_f8, (DOUBLE returnValue, OFFSET offset)) { leaveMain(offset, 1, InlineOperands{{ mkop_f8(returnValue) }}.data()); }
+PROBE(void, Track_LeaveMain_p, (INT_PTR returnValue, OFFSET offset)) { leaveMain(offset, 1, InlineOperands{{ mkop_p(returnValue) }}.data()); }
 
 PROBE(void, Finalize_Call, (UINT8 returnValues)) {
     Stack &stack = vsharp::stack();
@@ -766,26 +826,24 @@ PROBE(VOID, PushFrame, (mdToken unresolvedToken, mdMethodDef resolvedToken, bool
     Stack &stack = vsharp::stack();
     StackFrame &top = stack.topFrame();
     argsCount = newobj ? argsCount + 1 : argsCount;
-    bool *argsConcreteness = new bool[argsCount];
-    if (newobj) {
-        argsConcreteness[0] = true;
-    }
-    memset(newobj ? argsConcreteness + 1 : argsConcreteness, true, argsCount);
     LOG(tout << "Call: resolved_token = " << HEX(resolvedToken) << ", unresolved_token = " << HEX(unresolvedToken) << "\n"
              << "\t\tbalance after pop: " << top.count() << "; pushing frame " << stack.framesCount() + 1 << std::endl);
+    // NOTE: 'top' may be invalidated by the push, so popped symbolics are copied out of it first
     const std::vector<std::pair<unsigned, unsigned>> &poppedSymbs = top.poppedSymbolics();
+    auto &symbolicArgs = commandScratch.symbolicArgs;
+    symbolicArgs.clear();
     for (auto &pair : poppedSymbs) {
         assert((int)argsCount - (int)pair.second - 1 >= 0);
         unsigned idx = argsCount - pair.second - 1;
         assert(idx < argsCount);
-        argsConcreteness[idx] = false;
+        symbolicArgs.push_back(idx);
     }
+    StackFrame &frame = stack.pushFrame(resolvedToken, unresolvedToken, argsCount, true);
+    for (unsigned idx : symbolicArgs)
+        frame.setArg(idx, false);
     LOG(tout << "Args concreteness: ";
         for (unsigned i = 0; i < argsCount; ++i)
-            tout << argsConcreteness[i];);
-
-    stack.pushFrame(resolvedToken, unresolvedToken, argsConcreteness, argsCount);
-    delete[] argsConcreteness;
+            tout << frame.arg(i););
 }
 
 PROBE(void, Track_CallVirt, (UINT16 count, OFFSET offset)) { Track_Call(count); PushFrame(0, 0, false, count, offset); }
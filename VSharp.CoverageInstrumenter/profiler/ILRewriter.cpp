@@ -409,26 +409,16 @@ ILRewriter::ILRewriter(
     mdToken tkMethod)
     : m_pICorProfilerInfo(pICorProfilerInfo), m_pICorProfilerFunctionControl(pICorProfilerFunctionControl),
       m_moduleId(moduleID), m_tkMethod(tkMethod), m_fGenerateTinyHeader(false),
-      m_pEH(nullptr), m_pOffsetToInstr(nullptr), m_pOutputBuffer(nullptr), m_pIMethodMalloc(nullptr)
+      m_CodeSize(0), m_nInstrs(0), m_instrBlockSize(0), m_instrBlockUsed(0), m_fILVectorValid(false),
+      m_pIMethodMalloc(nullptr), m_pExported(nullptr), m_pEH(nullptr)
 {
     m_IL.m_pNext = &m_IL;
     m_IL.m_pPrev = &m_IL;
-
-    m_nInstrs = 0;
 }
 
 ILRewriter::~ILRewriter()
 {
-    ILInstr * p = m_IL.m_pNext;
-    while (p != &m_IL)
-    {
-        ILInstr * t = p->m_pNext;
-        delete p;
-        p = t;
-    }
     delete[] m_pEH;
-    delete[] m_pOffsetToInstr;
-    delete[] m_pOutputBuffer;
 
     if (m_pIMethodMalloc)
         m_pIMethodMalloc->Release();
@@ -459,13 +449,13 @@ HRESULT ILRewriter::Import()
 
 HRESULT ILRewriter::ImportIL(LPCBYTE pIL)
 {
-    m_pOffsetToInstr = new ILInstr*[m_CodeSize + 1];
-    IfNullRet(m_pOffsetToInstr);
+    m_offsetToInstr.assign(m_CodeSize + 1, nullptr);
 
-    ZeroMemory(m_pOffsetToInstr, m_CodeSize * sizeof(ILInstr*));
+    // Every instruction takes at least one byte, the rest is left for the probes
+    ReserveInstrs(m_CodeSize + m_CodeSize / 2 + 16);
 
     // Set the sentinel instruction
-    m_pOffsetToInstr[m_CodeSize] = &m_IL;
+    m_offsetToInstr[m_CodeSize] = &m_IL;
     m_IL.m_opcode = -1;
 
     bool fBranch = false;
@@ -514,7 +504,9 @@ HRESULT ILRewriter::ImportIL(LPCBYTE pIL)
 
         InsertBefore(&m_IL, pInstr);
 
-        m_pOffsetToInstr[startOffset] = pInstr;
+        m_offsetToInstr[startOffset] = pInstr;
+        // the original offsets identify the coverage points until the method is exported
+        pInstr->m_offset = startOffset;
 
         switch (flags)
         {
@@ -566,6 +558,7 @@ HRESULT ILRewriter::ImportIL(LPCBYTE pIL)
                     IfNullRet(pInstr);
 
                     pInstr->m_opcode = CEE_SWITCH_ARG;
+                    pInstr->m_offset = offset;
 
                     pInstr->m_Arg32 = base + *(UNALIGNED INT32 *)&(pIL[offset]);
                     offset += sizeof(INT32);
@@ -631,10 +624,23 @@ HRESULT ILRewriter::ImportEH(const COR_ILMETHOD_SECT_EH* pILEH, unsigned nEH)
     return S_OK;
 }
 
+void ILRewriter::ReserveInstrs(unsigned count)
+{
+    if (m_instrBlockSize - m_instrBlockUsed >= count)
+        return;
+    // value-initialization zeroes the instructions, like 'new ILInstr()' did
+    m_instrBlocks.emplace_back(new ILInstr[count]());
+    m_instrBlockSize = count;
+    m_instrBlockUsed = 0;
+}
+
 ILInstr* ILRewriter::NewILInstr()
 {
+    if (m_instrBlockUsed == m_instrBlockSize)
+        ReserveInstrs(m_nInstrs / 2 + 16);
     m_nInstrs++;
-    return new ILInstr();
+    m_fILVectorValid = false;
+    return &m_instrBlocks.back()[m_instrBlockUsed++];
 }
 
 ILInstr* ILRewriter::GetInstrFromOffset(unsigned offset)
@@ -642,7 +648,7 @@ ILInstr* ILRewriter::GetInstrFromOffset(unsigned offset)
     ILInstr * pInstr = NULL;
 
     if (offset <= m_CodeSize)
-        pInstr = m_pOffsetToInstr[offset];
+        pInstr = m_offsetToInstr[offset];
 
     assert(pInstr != NULL);
     return pInstr;
@@ -663,6 +669,7 @@ void ILRewriter::PrintEhs()
 
 void ILRewriter::InsertBefore(ILInstr * pWhere, ILInstr * pWhat)
 {
+    m_fILVectorValid = false;
     pWhat->m_pNext = pWhere;
     pWhat->m_pPrev = pWhere->m_pPrev;
 
@@ -674,6 +681,7 @@ void ILRewriter::InsertBefore(ILInstr * pWhere, ILInstr * pWhat)
 
 void ILRewriter::InsertAfter(ILInstr * pWhere, ILInstr * pWhat)
 {
+    m_fILVectorValid = false;
     pWhat->m_pNext = pWhere->m_pNext;
     pWhat->m_pPrev = pWhere;
 
@@ -694,6 +702,22 @@ ILInstr * ILRewriter::GetILList()
     return &m_IL;
 }
 
+const std::vector<ILInstr *> &ILRewriter::GetILVector()
+{
+    if (m_fILVectorValid)
+        return m_ILVector;
+    m_ILVector.clear();
+    m_ILVector.reserve(m_nInstrs);
+    for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+    {
+        pInstr->m_index = (unsigned) m_ILVector.size();
+        m_ILVector.push_back(pInstr);
+    }
+    m_IL.m_index = (unsigned) m_ILVector.size();
+    m_fILVectorValid = true;
+    return m_ILVector;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////
 //
 // E X P O R T
@@ -701,26 +725,69 @@ ILInstr * ILRewriter::GetILList()
 ////////////////////////////////////////////////////////////////////////////////////////////////
 
 
-HRESULT ILRewriter::Export()
+// Size of the instruction's encoding; switch arguments are the 4-byte targets following CEE_SWITCH
+static unsigned InstrSize(const ILInstr *pInstr)
 {
-    // One instruction produces 2 + sizeof(native int) bytes in the worst case which can be 10 bytes for 64-bit.
-    // For simplification we just use 10 here.
-    unsigned maxSize = m_nInstrs * 10;
+    unsigned opcode = pInstr->m_opcode;
+    unsigned size = 0;
+    if (opcode < CEE_COUNT)
+        size += opcode >= 0x100 ? 2 : 1;
+
+    BYTE flags = s_OpCodeFlags[opcode];
+    if (flags & OPCODEFLAGS_Switch)
+        size += sizeof(INT32);
+    return size + (flags & OPCODEFLAGS_SizeMask);
+}
 
-    m_pOutputBuffer = new BYTE[maxSize];
-    IfNullRet(m_pOutputBuffer);
+unsigned ILRewriter::LayoutInstrs()
+{
+    const std::vector<ILInstr *> &instrs = GetILVector();
+    unsigned offset = 0;
+    bool fWidened;
+    do
+    {
+        offset = 0;
+        for (ILInstr * pInstr : instrs)
+        {
+            pInstr->m_offset = offset;
+            offset += InstrSize(pInstr);
+        }
+        m_IL.m_offset = offset;
 
-    again:
-    BYTE * pIL = m_pOutputBuffer;
+        // Widening a branch only moves the following instructions forward, so this converges
+        fWidened = false;
+        for (ILInstr * pInstr : instrs)
+        {
+            if (s_OpCodeFlags[pInstr->m_opcode] != (1 | OPCODEFLAGS_BranchTarget))
+                continue;
+            int delta = pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset;
+            // (see #pragma at top of file)
+            if ((INT8)delta == delta)
+                continue;
+            unsigned opcode = pInstr->m_opcode;
+            if (opcode == CEE_LEAVE_S)
+            {
+                pInstr->m_opcode = CEE_LEAVE;
+            }
+            else
+            {
+                assert(opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S);
+                pInstr->m_opcode = opcode - CEE_BR_S + CEE_BR;
+                assert(pInstr->m_opcode >= CEE_BR && pInstr->m_opcode <= CEE_BLT_UN);
+            }
+            fWidened = true;
+        }
+    } while (fWidened);
 
-    bool fBranch = false;
-    unsigned offset = 0;
+    return offset;
+}
 
-    // Go over all instructions and produce code for them
-    for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+void ILRewriter::EmitInstrs(BYTE *pIL)
+{
+    unsigned switchBase = 0;
+    for (ILInstr * pInstr : GetILVector())
     {
-        assert(offset < maxSize);
-        pInstr->m_offset = offset;
+        unsigned offset = pInstr->m_offset;
 
         unsigned opcode = pInstr->m_opcode;
         if (opcode < CEE_COUNT)
@@ -729,15 +796,15 @@ HRESULT ILRewriter::Export()
             // the lead byte of multi-byte opcodes. For now, the only lead byte
             // supported is CEE_PREFIX1 = 0xFE.
             if (opcode >= 0x100)
-                m_pOutputBuffer[offset++] = CEE_PREFIX1;
+                pIL[offset++] = CEE_PREFIX1;
 
             // This appears to depend on an implicit conversion from
             // unsigned opcode down to BYTE, to deliberately lose data and have
             // opcode >= 0x100 wrap around to 0.
-            m_pOutputBuffer[offset++] = (opcode & 0xFF);
+            pIL[offset++] = (opcode & 0xFF);
         }
 
-        BYTE flags = s_OpCodeFlags[pInstr->m_opcode];
+        BYTE flags = s_OpCodeFlags[opcode];
         switch (flags)
         {
             case 0:
@@ -755,94 +822,37 @@ HRESULT ILRewriter::Export()
                 *(UNALIGNED INT64 *)&(pIL[offset]) = pInstr->m_Arg64;
                 break;
             case 1 | OPCODEFLAGS_BranchTarget:
-                fBranch = true;
+                *(UNALIGNED INT8 *)&(pIL[offset]) = pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset;
                 break;
             case 4 | OPCODEFLAGS_BranchTarget:
-                fBranch = true;
+                // Switch args are relative to the end of the whole switch
+                if (opcode == CEE_SWITCH_ARG)
+                    *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_pTarget->m_offset - switchBase;
+                else
+                    *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset;
                 break;
             case 0 | OPCODEFLAGS_Switch:
                 *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_Arg32;
-                offset += sizeof(INT32);
+                switchBase = pInstr->m_offset + 1 + sizeof(INT32) * (pInstr->m_Arg32 + 1);
                 break;
             default:
                 assert(false);
                 break;
         }
-        offset += (flags & OPCODEFLAGS_SizeMask);
-    }
-    m_IL.m_offset = offset;
-
-    if (fBranch)
-    {
-        bool fTryAgain = false;
-        unsigned switchBase = 0;
-
-        // Go over all control flow instructions and resolve the targets
-        for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
-        {
-            unsigned opcode = pInstr->m_opcode;
-
-            if (pInstr->m_opcode == CEE_SWITCH)
-            {
-                switchBase = pInstr->m_offset + 1 + sizeof(INT32) * (pInstr->m_Arg32 + 1);
-                continue;
-            }
-            if (opcode == CEE_SWITCH_ARG)
-            {
-                // Switch args are special
-                *(UNALIGNED INT32 *)&(pIL[pInstr->m_offset]) = pInstr->m_pTarget->m_offset - switchBase;
-                continue;
-            }
-
-            BYTE flags = s_OpCodeFlags[pInstr->m_opcode];
-
-            if (flags & OPCODEFLAGS_BranchTarget)
-            {
-                int delta = pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset;
-
-                switch (flags)
-                {
-                    case 1 | OPCODEFLAGS_BranchTarget:
-                        // Check if delta is too big to fit into an INT8.
-                        //
-                        // (see #pragma at top of file)
-                        if ((INT8)delta != delta)
-                        {
-                            if (opcode == CEE_LEAVE_S)
-                            {
-                                pInstr->m_opcode = CEE_LEAVE;
-                            }
-                            else
-                            {
-                                assert(opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S);
-                                pInstr->m_opcode = opcode - CEE_BR_S + CEE_BR;
-                                assert(pInstr->m_opcode >= CEE_BR && pInstr->m_opcode <= CEE_BLT_UN);
-                            }
-                            fTryAgain = true;
-                            continue;
-                        }
-                        *(UNALIGNED INT8 *)&(pIL[pInstr->m_pNext->m_offset - sizeof(INT8)]) = delta;
-                        break;
-                    case 4 | OPCODEFLAGS_BranchTarget:
-                        *(UNALIGNED INT32 *)&(pIL[pInstr->m_pNext->m_offset - sizeof(INT32)]) = delta;
-                        break;
-                    default:
-                        assert(false);
-                        break;
-                }
-            }
-        }
-
-        // Do the whole thing again if we changed the size of some branch targets
-        if (fTryAgain)
-            goto again;
     }
+}
 
-    unsigned codeSize = offset;
+HRESULT ILRewriter::Export()
+{
+    // Encodings of the branches are chosen on offsets alone, then the code is emitted once right into the body
+    unsigned codeSize = LayoutInstrs();
     unsigned totalSize;
+    unsigned headerSize;
     LPBYTE pBody = NULL;
     if (m_fGenerateTinyHeader)
     {
+        headerSize = sizeof(IMAGE_COR_ILMETHOD_TINY);
+
         // Make sure we can fit in a tiny header
         if (codeSize >= 64)
             return E_FAIL;
@@ -858,13 +868,14 @@ HRESULT ILRewriter::Export()
         pCurrent += sizeof(IMAGE_COR_ILMETHOD_TINY);
 
         // And the body
-        CopyMemory(pCurrent, m_pOutputBuffer, codeSize);
+        EmitInstrs(pCurrent);
     }
     else
     {
         // Use FAT header
+        headerSize = sizeof(IMAGE_COR_ILMETHOD_FAT);
 
-        unsigned alignedCodeSize = (offset + 3) & ~3;
+        unsigned alignedCodeSize = (codeSize + 3) & ~3;
 
         totalSize = sizeof(IMAGE_COR_ILMETHOD_FAT) + alignedCodeSize +
                     (m_nEH ? (sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH) : 0);
@@ -878,12 +889,14 @@ HRESULT ILRewriter::Export()
         pHeader->Flags = m_flags | (m_nEH ? CorILMethod_MoreSects : 0) | CorILMethod_FatFormat;
         pHeader->Size = sizeof(IMAGE_COR_ILMETHOD_FAT) / sizeof(DWORD);
         pHeader->MaxStack = m_maxStack;
-        pHeader->CodeSize = offset;
+        pHeader->CodeSize = codeSize;
         pHeader->LocalVarSigTok = m_tkLocalVarSig;
 
         pCurrent = (BYTE*)(pHeader + 1);
 
-        CopyMemory(pCurrent, m_pOutputBuffer, codeSize);
+        EmitInstrs(pCurrent);
+        // the padding before the EH section
+        ZeroMemory(pCurrent + codeSize, alignedCodeSize - codeSize);
         pCurrent += alignedCodeSize;
 
         if (m_nEH != 0)
@@ -914,12 +927,30 @@ HRESULT ILRewriter::Export()
         }
     }
 
+    if (m_pExported != nullptr)
+    {
+        m_pExported->body.assign(pBody, pBody + totalSize);
+        m_pExported->relocations.clear();
+        for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+        {
+            if (pInstr->m_relocation == vsharp::NoRelocation)
+                continue;
+            unsigned opcodeSize = pInstr->m_opcode >= 0x100 ? 2 : 1;
+            m_pExported->relocations.push_back({ headerSize + pInstr->m_offset + opcodeSize, pInstr->m_relocation, pInstr->m_relocationArg });
+        }
+    }
+
     IfFailRet(SetILFunctionBody(totalSize, pBody));
     DeallocateILMemory(pBody);
 
     return S_OK;
 }
 
+void ILRewriter::KeepExportedBody(vsharp::CachedILBody *pExported)
+{
+    m_pExported = pExported;
+}
+
 HRESULT ILRewriter::SetILFunctionBody(unsigned size, LPBYTE pBody)
 {
     if (m_pICorProfilerFunctionControl != NULL)
@@ -965,6 +996,30 @@ void ILRewriter::DeallocateILMemory(LPBYTE pBody)
     delete[] pBody;
 }
 
+const UINT32 vsharp::relocatableProbesCount = 11;
+
+// stable numbering of probes for relocations of cached IL
+vsharp::ProbeCall *ProbeByIndex(unsigned index) {
+    auto covProb = vsharp::getProbes();
+    vsharp::ProbeCall *probes[] = {
+        covProb->Coverage, covProb->Stsfld, covProb->Branch, covProb->Enter, covProb->EnterMain, covProb->Leave,
+        covProb->LeaveMain, covProb->Finalize_Call, covProb->Call, covProb->Tailcall, covProb->Throw
+    };
+    static_assert(sizeof(probes) / sizeof(probes[0]) == vsharp::relocatableProbesCount, "probes table and its size differ");
+    return index < vsharp::relocatableProbesCount ? probes[index] : nullptr;
+}
+
+// 'relocatableProbesCount' for unknown probes, such bodies are rejected by the cache
+unsigned ProbeIndex(UINT_PTR methodAddress) {
+    unsigned index = 0;
+    for (vsharp::ProbeCall *probe = ProbeByIndex(index); probe != nullptr; probe = ProbeByIndex(++index)) {
+        if (probe->addr == methodAddress)
+            break;
+    }
+    assert(ProbeByIndex(index) != nullptr);
+    return index;
+}
+
 HRESULT AddProbe(
     ILRewriter * pilr,
     UINT_PTR methodAddress,
@@ -972,17 +1027,22 @@ HRESULT AddProbe(
     ILInstr *pInsertProbeBeforeThisInstr)
 {
     ILInstr * pNewInstr = nullptr;
+    unsigned probeIndex = ProbeIndex(methodAddress);
 
     constexpr auto CEE_LDC_I = sizeof(size_t) == 8 ? CEE_LDC_I8 : sizeof(size_t) == 4 ? CEE_LDC_I4 : throw std::logic_error("size_t must be defined as 8 or 4");
 
     pNewInstr = pilr->NewILInstr();
     pNewInstr->m_opcode = CEE_LDC_I;
     pNewInstr->m_Arg64 = methodAddress;
+    pNewInstr->m_relocation = vsharp::ProbeAddressRelocation;
+    pNewInstr->m_relocationArg = probeIndex;
     pilr->InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
 
     pNewInstr = pilr->NewILInstr();
     pNewInstr->m_opcode = CEE_CALLI;
     pNewInstr->m_Arg32 = methodSignature;
+    pNewInstr->m_relocation = vsharp::ProbeSignatureRelocation;
+    pNewInstr->m_relocationArg = probeIndex;
     pilr->InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
 
     return S_OK;
@@ -1030,6 +1090,7 @@ HRESULT AddEnterProbe(
     offsetInstr = pilr->NewILInstr();
     offsetInstr->m_opcode = CEE_LDC_I4;
     offsetInstr->m_Arg32 = (INT32)methodId;
+    offsetInstr->m_relocation = vsharp::MethodIdRelocation;
     pilr->InsertBefore(pFirstOriginalInstr, offsetInstr);
 
     ILInstr * spontaneousInstr;
@@ -1040,52 +1101,6 @@ HRESULT AddEnterProbe(
     return AddProbe(pilr, methodAddress, methodSignature, pFirstOriginalInstr);
 }
 
-void countOffsets(ILRewriter *pilr) {
-    unsigned offset = 0;
-
-    ILInstr *first = pilr->GetILList();
-
-    // Go over all instructions and produce code for them
-    for (ILInstr * pInstr = first->m_pNext; pInstr != first; pInstr = pInstr->m_pNext)
-    {
-        pInstr->m_offset = offset;
-
-        unsigned opcode = pInstr->m_opcode;
-        if (opcode < CEE_COUNT)
-        {
-            // CEE_PREFIX1 refers not to instruction prefixes (like tail.), but to
-            // the lead byte of multi-byte opcodes. For now, the only lead byte
-            // supported is CEE_PREFIX1 = 0xFE.
-            if (opcode >= 0x100)
-                offset++;
-
-            // This appears to depend on an implicit conversion from
-            // unsigned opcode down to BYTE, to deliberately lose data and have
-            // opcode >= 0x100 wrap around to 0.
-            offset++;
-        }
-
-        BYTE flags = s_OpCodeFlags[pInstr->m_opcode];
-        switch (flags)
-        {
-            case 0:
-            case 1:
-            case 2:
-            case 4:
-            case 8:
-            case 1 | OPCODEFLAGS_BranchTarget:
-            case 4 | OPCODEFLAGS_BranchTarget:
-                break;
-            case 0 | OPCODEFLAGS_Switch:
-                offset += sizeof(INT32);
-                break;
-            default:
-                break;
-        }
-        offset += (flags & OPCODEFLAGS_SizeMask);
-    }
-}
-
 // returns pointer to the new instruction
 ILInstr *AddLDCInstrBefore(ILRewriter *pilr, ILInstr *pInstr, INT32 arg) {
     ILInstr *pNewInstr = pilr->NewILInstr();
@@ -1127,6 +1142,74 @@ void PrintILInstructions(ILRewriter *pilr) {
     pilr->PrintEhs();
 }
 
+vsharp::CoverageEvent CounterEvent(vsharp::ProbeCall* probe) {
+    auto covProb = vsharp::getProbes();
+    if (probe == covProb->Branch) return vsharp::BranchHit;
+    if (probe == covProb->Call) return vsharp::Call;
+    if (probe == covProb->Tailcall) return vsharp::Tailcall;
+    if (probe == covProb->Stsfld) return vsharp::StsfldHit;
+    if (probe == covProb->EnterMain) return vsharp::EnterMain;
+    if (probe == covProb->Enter) return vsharp::Enter;
+    if (probe == covProb->LeaveMain) return vsharp::LeaveMain;
+    // 'Track_Throw' is recorded as leave
+    if (probe == covProb->Leave || probe == covProb->Throw) return vsharp::Leave;
+    return vsharp::TrackCoverage;
+}
+
+// saturating increment of the counter: c = (c + 1) - ((c + 1) >> 8), leaves the stack as it was
+HRESULT AddCounterProbe(
+    ILRewriter *pilr,
+    vsharp::CounterSlab *counters,
+    BYTE *counter,
+    ILInstr *pInsertProbeBeforeThisInstr)
+{
+    constexpr auto CEE_LDC_I = sizeof(size_t) == 8 ? CEE_LDC_I8 : sizeof(size_t) == 4 ? CEE_LDC_I4 : throw std::logic_error("size_t must be defined as 8 or 4");
+
+    unsigned opcodes[] = {
+        CEE_LDC_I, CEE_CONV_U, CEE_DUP, CEE_LDIND_U1, CEE_LDC_I4_1, CEE_ADD,
+        CEE_DUP, CEE_LDC_I4_8, CEE_SHR_UN, CEE_SUB, CEE_STIND_I1
+    };
+    for (auto opcode : opcodes) {
+        ILInstr *pNewInstr = pilr->NewILInstr();
+        pNewInstr->m_opcode = opcode;
+        if (opcode == CEE_LDC_I) {
+            pNewInstr->m_Arg64 = (INT64) counter;
+            pNewInstr->m_relocation = vsharp::CounterRelocation;
+            pNewInstr->m_relocationArg = (unsigned) counters->counterIndex(counter);
+        }
+        pilr->InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
+    }
+
+    return S_OK;
+}
+
+// inserts either the call of the probe or the inlined increment of the counter of this coverage point
+HRESULT AddCoverageProbeCall(
+    ILRewriter *pilr,
+    OFFSET offset,
+    vsharp::ProbeCall* probe,
+    int methodId,
+    vsharp::CounterSlab* counters,
+    ILInstr *pInsertProbeBeforeThisInstr,
+    const unsigned *region = nullptr)
+{
+    if (counters != nullptr) {
+        BYTE* counter = region == nullptr
+            ? counters->addPoint(offset, CounterEvent(probe))
+            : counters->addPoint(offset, CounterEvent(probe), *region);
+        // the region is already counted by another point
+        if (counter == nullptr)
+            return S_OK;
+        return AddCounterProbe(pilr, counters, counter, pInsertProbeBeforeThisInstr);
+    }
+
+    AddLDCInstrBefore(pilr, pInsertProbeBeforeThisInstr, (INT32)offset);
+
+    AddLDCInstrBefore(pilr, pInsertProbeBeforeThisInstr, methodId)->m_relocation = vsharp::MethodIdRelocation;
+
+    return AddProbe(pilr, probe->addr, probe->getSig(), pInsertProbeBeforeThisInstr);
+}
+
 void CorrectHandlers(ILRewriter* pilr, ILInstr* pInstr, ILInstr* pNewInstr)
 {
     // changing exception handlers bounds if we were on the end of handler block
@@ -1144,19 +1227,17 @@ HRESULT AddCoverageProbeAfter(
     ILRewriter* pilr,
     ILInstr*& pInstr,
     vsharp::ProbeCall* probe,
-    int methodId)
+    int methodId,
+    vsharp::CounterSlab* counters = nullptr,
+    const unsigned *region = nullptr)
 {
     // new instruction for easier exception handling
     ILInstr* pNewInstr = pilr->NewILInstr();
     pNewInstr->m_opcode = CEE_NOP;
     pilr->InsertAfter(pInstr, pNewInstr);
 
-    AddLDCInstrBefore(pilr, pNewInstr, (INT32)pInstr->m_offset);
-
-    AddLDCInstrBefore(pilr, pNewInstr, methodId);
-
     // adding the probe
-    IfFailRet(AddProbe(pilr, probe->addr, probe->getSig(), pNewInstr));
+    IfFailRet(AddCoverageProbeCall(pilr, pInstr->m_offset, probe, methodId, counters, pNewInstr, region));
 
     CorrectHandlers(pilr, pInstr, pNewInstr);
 
@@ -1169,7 +1250,9 @@ HRESULT AddCoverageProbeBefore(
         ILRewriter *pilr,
         ILInstr *&pInstr,
         vsharp::ProbeCall* probe,
-        int methodId)
+        int methodId,
+        vsharp::CounterSlab* counters = nullptr,
+        const unsigned *region = nullptr)
 {
     // adding the new instruction
     ILInstr * pNewInstr = pilr->NewILInstr();
@@ -1179,12 +1262,8 @@ HRESULT AddCoverageProbeBefore(
 
     pInstr->m_opcode = CEE_NOP;
 
-    AddLDCInstrBefore(pilr, pNewInstr, (INT32)pInstr->m_offset);
-
-    AddLDCInstrBefore(pilr, pNewInstr, methodId);
-
     // adding the probe
-    IfFailRet(AddProbe(pilr, probe->addr, probe->getSig(), pNewInstr));
+    IfFailRet(AddCoverageProbeCall(pilr, pInstr->m_offset, probe, methodId, counters, pNewInstr, region));
 
     CorrectHandlers(pilr, pInstr, pNewInstr);
 
@@ -1230,22 +1309,81 @@ HRESULT AddExitProbe(
     return S_OK;
 }
 
-HRESULT MakeProbeInsertion(ILRewriter *pilr, ProbeInsertion toInsert, int methodId) {
+bool OpcodeIsBranch(unsigned opcode) {
+    return
+        (CEE_BR_S <= opcode && opcode <= CEE_SWITCH)
+        || opcode == CEE_LEAVE || opcode == CEE_LEAVE_S;
+}
+
+// instructions that can neither throw nor transfer control
+bool IsStraightLineInstr(ILInstr *pInstr) {
+    unsigned opcode = pInstr->m_opcode;
+    return
+        (CEE_NOP <= opcode && opcode <= CEE_LDC_R8 && opcode != CEE_BREAK)
+        || opcode == CEE_DUP || opcode == CEE_POP || opcode == CEE_LDSTR || opcode == CEE_LDNULL
+        || (CEE_ADD <= opcode && opcode <= CEE_MUL) || (CEE_AND <= opcode && opcode <= CEE_NOT)
+        || (CEE_CONV_I1 <= opcode && opcode <= CEE_CONV_U8) || opcode == CEE_CONV_R_UN
+        || opcode == CEE_CONV_I || opcode == CEE_CONV_U || opcode == CEE_CONV_U2 || opcode == CEE_CONV_U1
+        || (CEE_CEQ <= opcode && opcode <= CEE_CLT_UN)
+        || (CEE_LDARG <= opcode && opcode <= CEE_STLOC);
+}
+
+// Numbers straight-line regions of the method: all coverage points of a region are reached the same number of times.
+// A region ends after an instruction which may throw or transfer control, and starts anew at every place control
+// can come from elsewhere. 'regionBefore' is the region where jumps to the instruction land, 'regionAfter' is the
+// region right after the instruction
+void ComputeRegions(
+    ILRewriter *pilr,
+    std::vector<unsigned> &regionBefore,
+    std::vector<unsigned> &regionAfter)
+{
+    // indexed by ILInstr::m_index, the last entry is the end of the method
+    const std::vector<ILInstr *> &instrs = pilr->GetILVector();
+    std::vector<bool> entries(instrs.size() + 1, false);
+    for (ILInstr *pInstr : instrs) {
+        if (OpcodeIsBranch(pInstr->m_opcode) || pInstr->m_opcode == CEE_SWITCH_ARG)
+            entries[pInstr->m_pTarget->m_index] = true;
+    }
+    for (unsigned i = 0; i < pilr->m_nEH; i++) {
+        EHClause &clause = pilr->m_pEH[i];
+        entries[clause.m_pTryBegin->m_index] = true;
+        entries[clause.m_pTryEnd->m_index] = true;
+        entries[clause.m_pHandlerBegin->m_index] = true;
+        entries[clause.m_pHandlerEnd->m_pNext->m_index] = true;
+        if ((clause.m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) != 0)
+            entries[clause.m_pFilter->m_index] = true;
+    }
+
+    // region 0 is the method's enter
+    unsigned region = 0;
+    regionBefore.resize(instrs.size());
+    regionAfter.resize(instrs.size());
+    for (ILInstr *pInstr : instrs) {
+        if (entries[pInstr->m_index])
+            region++;
+        regionBefore[pInstr->m_index] = region;
+        if (!IsStraightLineInstr(pInstr))
+            region++;
+        regionAfter[pInstr->m_index] = region;
+    }
+}
+
+HRESULT MakeProbeInsertion(
+    ILRewriter *pilr,
+    ProbeInsertion toInsert,
+    int methodId,
+    vsharp::CounterSlab* counters,
+    const unsigned *region)
+{
     if (toInsert.isBeforeInstr) {
-        IfFailRet(AddCoverageProbeBefore(pilr, toInsert.target, toInsert.probe, methodId));
+        IfFailRet(AddCoverageProbeBefore(pilr, toInsert.target, toInsert.probe, methodId, counters, region));
     }
     else {
-        IfFailRet(AddCoverageProbeAfter(pilr, toInsert.target, toInsert.probe, methodId));
+        IfFailRet(AddCoverageProbeAfter(pilr, toInsert.target, toInsert.probe, methodId, counters, region));
     }
     return S_OK;
 }
 
-bool OpcodeIsBranch(unsigned opcode) {
-    return
-        (CEE_BR_S <= opcode && opcode <= CEE_SWITCH)
-        || opcode == CEE_LEAVE || opcode == CEE_LEAVE_S;
-}
-
 // Uses the general-purpose ILRewriter class to import original
 // IL, rewrite it, and send the result to the CLR
 HRESULT RewriteIL(
@@ -1255,10 +1393,13 @@ HRESULT RewriteIL(
         mdMethodDef methodDef,
         int methodId,
         bool isMain,
-        bool rewriteMainOnly)
+        bool rewriteMainOnly,
+        bool withCounters,
+        vsharp::CachedILBody *exported)
 {
     ILRewriter rewriter(pICorProfilerInfo, pICorProfilerFunctionControl, moduleID, methodDef);
     auto pilr = &rewriter;
+    rewriter.KeepExportedBody(exported);
 
     auto covProb = vsharp::getProbes();
 
@@ -1274,7 +1415,6 @@ HRESULT RewriteIL(
     }
 
     IfFailRet(rewriter.Import());
-    countOffsets(&rewriter);
 
     // if main-only requested, keeping enter/leave probes for stack balances, cutting everything else
     if (rewriteMainOnly && !isMain) {
@@ -1412,9 +1552,25 @@ HRESULT RewriteIL(
         }
     }
 
+    // every straight-line region with coverage points gets its own counter, the first one is reserved for the enter
+    vsharp::CounterSlab* counters = nullptr;
+    BYTE* enterCounter = nullptr;
+    // indexed by ILInstr::m_index, which stays valid for the instructions listed before the probes are inserted
+    std::vector<unsigned> regionBefore;
+    std::vector<unsigned> regionAfter;
+    if (withCounters) {
+        ComputeRegions(pilr, regionBefore, regionAfter);
+        counters = vsharp::coverageTracker->allocateCounters(methodId, 1 + addPriorityProbe.size() + addTargetProbe.size());
+        unsigned enterRegion = 0;
+        enterCounter = counters->addPoint(pilr->GetILList()->m_pNext->m_offset, CounterEvent(enterMethod), enterRegion);
+    }
+
     for (auto &insertion : addPriorityProbe) {
         // TODO: tailcall + ret can be broken into two basic blocks; but adding two probes is impossible
-        IfFailRet(MakeProbeInsertion(pilr, insertion, methodId));
+        unsigned region = 0;
+        if (withCounters)
+            region = insertion.isBeforeInstr ? regionBefore[insertion.target->m_index] : regionAfter[insertion.target->m_index];
+        IfFailRet(MakeProbeInsertion(pilr, insertion, methodId, counters, withCounters ? &region : nullptr));
         coveredInstructions.insert(insertion.target->m_offset);
     }
 
@@ -1429,7 +1585,8 @@ HRESULT RewriteIL(
 
         // targets on returns under tailcall require special treatment
         if (!IsTailcallRet(target->m_pNext)) {
-            IfFailRet(AddCoverageProbeAfter(pilr, target, insertion.probe, methodId));
+            unsigned region = withCounters ? regionAfter[target->m_index] : 0;
+            IfFailRet(AddCoverageProbeAfter(pilr, target, insertion.probe, methodId, counters, withCounters ? &region : nullptr));
             continue;
         }
         // target is a ret after a tailcall:
@@ -1454,16 +1611,11 @@ HRESULT RewriteIL(
         pNewRet->m_opcode = CEE_RET;
         pilr->InsertAfter(branch, pNewRet);
 
-        // remembering the original ret's offset
-        ILInstr* probeStart = AddLDCInstrBefore(pilr, pNewRet, (INT32)target->m_offset);
-
-        AddLDCInstrBefore(pilr, pNewRet, methodId);
-
-        // adding leave probe as it's a normal return without tailcall
-        IfFailRet(AddProbe(pilr, leaveMethod->addr, leaveMethod->getSig(), pNewRet));
+        // adding leave probe as it's a normal return without tailcall, remembering the original ret's offset
+        IfFailRet(AddCoverageProbeCall(pilr, target->m_offset, leaveMethod, methodId, counters, pNewRet));
 
         // rerouting the original branch target to our probe
-        branch->m_pTarget = probeStart;
+        branch->m_pTarget = branch->m_pNext;
 
         if (branch->m_opcode == CEE_BR || branch->m_opcode == CEE_BR_S)
             continue; // the branch is unconditional so we will always go to the target; no need for the skipping branch
@@ -1475,7 +1627,13 @@ HRESULT RewriteIL(
         pilr->InsertAfter(branch, skipBranch);
     }
 
-    IfFailRet(AddEnterProbe(&rewriter, enterMethod->addr, enterMethod->getSig(), methodId));
+    if (withCounters) {
+        LOG(tout << "counters of method " << methodId << ": " << counters->countersUsed() << " for " << counters->pointsCount() << " points");
+        IfFailRet(AddCounterProbe(pilr, counters, enterCounter, pilr->GetILList()->m_pNext));
+    }
+    else {
+        IfFailRet(AddEnterProbe(&rewriter, enterMethod->addr, enterMethod->getSig(), methodId));
+    }
 
     if (isMain) {
         LOG(tout << "rewritten main method: ");
@@ -1484,5 +1642,75 @@ HRESULT RewriteIL(
 
     IfFailRet(rewriter.Export());
 
+    if (exported != nullptr) {
+        exported->countersCount = counters == nullptr ? 0 : (UINT32) counters->countersUsed();
+        exported->counterPoints.clear();
+        if (counters != nullptr) {
+            for (auto &point : counters->getPoints())
+                exported->counterPoints.push_back({ point.offset, point.event, (UINT32) point.counter });
+        }
+    }
+
     return S_OK;
 }
+
+// Sets the body rewritten by another process, patching its process-dependent operands
+HRESULT ApplyCachedIL(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    int methodId,
+    const vsharp::CachedILBody &cached)
+{
+    // the entry is validated by the cache, but patching must never dereference a missing table
+    for (auto &relocation : cached.relocations) {
+        bool isProbe = relocation.kind == vsharp::ProbeAddressRelocation || relocation.kind == vsharp::ProbeSignatureRelocation;
+        if ((isProbe && ProbeByIndex(relocation.argument) == nullptr)
+            || (relocation.kind == vsharp::CounterRelocation && relocation.argument >= cached.countersCount))
+            return E_FAIL;
+    }
+
+    vsharp::CounterSlab* counters = nullptr;
+    if (cached.countersCount > 0) {
+        counters = vsharp::coverageTracker->allocateCounters(methodId, cached.countersCount);
+        for (auto &point : cached.counterPoints)
+            counters->restorePoint(point.offset, (vsharp::CoverageEvent) point.event, point.counter);
+    }
+
+    IMethodMalloc *pIMethodMalloc;
+    IfFailRet(pICorProfilerInfo->GetILFunctionBodyAllocator(moduleID, &pIMethodMalloc));
+    auto pBody = (LPBYTE) pIMethodMalloc->Alloc((ULONG) cached.body.size());
+    pIMethodMalloc->Release();
+    IfNullRet(pBody);
+    CopyMemory(pBody, cached.body.data(), cached.body.size());
+
+    for (auto &relocation : cached.relocations) {
+        BYTE *operand = pBody + relocation.position;
+        switch (relocation.kind) {
+            case vsharp::ProbeAddressRelocation:
+            case vsharp::CounterRelocation: {
+                UINT_PTR address = relocation.kind == vsharp::CounterRelocation
+                    ? (UINT_PTR) counters->counterAt(relocation.argument)
+                    : ProbeByIndex(relocation.argument)->addr;
+                CopyMemory(operand, &address, sizeof(UINT_PTR));
+                break;
+            }
+            case vsharp::ProbeSignatureRelocation: {
+                INT32 signature = (INT32) ProbeByIndex(relocation.argument)->getSig();
+                CopyMemory(operand, &signature, sizeof(INT32));
+                break;
+            }
+            case vsharp::MethodIdRelocation: {
+                INT32 id = methodId;
+                CopyMemory(operand, &id, sizeof(INT32));
+                break;
+            }
+            default:
+                return E_FAIL;
+        }
+    }
+
+    IfFailRet(pICorProfilerInfo->SetILFunctionBody(moduleID, methodDef, pBody));
+    return S_OK;
+}
+
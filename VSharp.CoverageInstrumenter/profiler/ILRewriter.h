@@ -4,8 +4,11 @@
 #include "corhlpr.h"
 #include "cor.h"
 #include "corprof.h"
+#include <memory>
 #include <stdexcept>
+#include <vector>
 #include "probes.h"
+#include "ilCache.h"
 
 #undef IfFailRet
 #define IfFailRet(EXPR) do { HRESULT hr = (EXPR); if(FAILED(hr)) { return (hr); } } while (0)
@@ -21,6 +24,11 @@ struct ILInstr
     unsigned        m_opcode;
     unsigned        m_offset;
 
+    unsigned        m_relocation;       // vsharp::ILRelocationKind of the operand
+    unsigned        m_relocationArg;
+
+    unsigned        m_index;            // position in ILRewriter::GetILVector(), valid until the list changes
+
     union
     {
         ILInstr *   m_pTarget;
@@ -70,19 +78,32 @@ private:
     // Helper table for importing.  Sparse array that maps BYTE offset of beginning of an
     // instruction to that instruction's ILInstr*.  BYTE offsets that don't correspond
     // to the beginning of an instruction are mapped to NULL.
-    ILInstr **m_pOffsetToInstr;
+    std::vector<ILInstr *> m_offsetToInstr;
     unsigned m_CodeSize;
 
     unsigned m_nInstrs;
 
-    BYTE *m_pOutputBuffer;
+    // Instructions are bump-allocated from blocks owned by the rewriter and released all together with it
+    std::vector<std::unique_ptr<ILInstr[]>> m_instrBlocks;
+    unsigned m_instrBlockSize;
+    unsigned m_instrBlockUsed;
+
+    // Instructions in the list order, rebuilt lazily after the list is changed
+    std::vector<ILInstr *> m_ILVector;
+    bool m_fILVectorValid;
 
     IMethodMalloc *m_pIMethodMalloc;
 
+    vsharp::CachedILBody *m_pExported; // receives the exported body if it is going to be cached
+
     HRESULT ImportIL(LPCBYTE pIL);
     HRESULT ImportEH(const COR_ILMETHOD_SECT_EH* pILEH, unsigned nEH);
     ILInstr* GetInstrFromOffset(unsigned offset);
     void AdjustState(ILInstr * pNewInstr);
+    void ReserveInstrs(unsigned count);
+    // Assigns the final offsets, widening the short branches which do not reach their targets; returns the code size
+    unsigned LayoutInstrs();
+    void EmitInstrs(BYTE *pIL);
     HRESULT SetILFunctionBody(unsigned size, LPBYTE pBody);
     LPBYTE AllocateILMemory(unsigned size);
     void DeallocateILMemory(LPBYTE pBody);
@@ -99,8 +120,11 @@ public:
 
     HRESULT Import();
     HRESULT Export();
+    void KeepExportedBody(vsharp::CachedILBody *pExported);
 
     ILInstr * GetILList();
+    // Read-only view for the analysis passes; the sentinel GetILList() gets the index equal to the vector's size
+    const std::vector<ILInstr *> &GetILVector();
     ILInstr* NewILInstr();
     void InsertBefore(ILInstr * pWhere, ILInstr * pWhat);
     void InsertAfter(ILInstr * pWhere, ILInstr * pWhat);
@@ -116,6 +140,15 @@ HRESULT RewriteIL(
     mdMethodDef methodDef,
     int methodId,
     bool isMain,
-    bool rewriteMainOnly);
+    bool rewriteMainOnly,
+    bool withCounters,
+    vsharp::CachedILBody *exported = nullptr);
+
+HRESULT ApplyCachedIL(
+    ICorProfilerInfo * pICorProfilerInfo,
+    ModuleID moduleID,
+    mdMethodDef methodDef,
+    int methodId,
+    const vsharp::CachedILBody &cached);
 
 #endif // ILREWRITER_H_
@@ -0,0 +1,126 @@
+#include "bitmap.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BITMAP_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AVX2_TARGET
+#else
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace vsharp;
+
+// AFL hit count buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+static BYTE bucketOf(BYTE hits) {
+    if (hits == 0) return 0;
+    if (hits <= 3) return static_cast<BYTE>(1 << (hits - 1));
+    if (hits <= 7) return 8;
+    if (hits <= 15) return 16;
+    if (hits <= 31) return 32;
+    if (hits <= 127) return 64;
+    return 128;
+}
+
+struct BucketTable {
+    BYTE buckets[256];
+    BucketTable() {
+        for (int i = 0; i < 256; i++)
+            buckets[i] = bucketOf(static_cast<BYTE>(i));
+    }
+};
+
+static const BucketTable bucketTable;
+
+// Most of the map is zero, so untouched blocks are skipped and only the touched ones are bucketized
+static void mergeRange(const BYTE* hits, BYTE* virgin, size_t from, size_t to, INT32 threadId, std::vector<BitmapUpdate>& updates) {
+    for (size_t i = from; i < to; i++) {
+        if (hits[i] == 0) continue;
+        BYTE bucket = bucketTable.buckets[hits[i]];
+        BYTE newBuckets = bucket & virgin[i];
+        if (newBuckets == 0) continue;
+        updates.push_back({threadId, static_cast<UINT32>(i), newBuckets, virgin[i] == 0xFF ? 1 : 0});
+        virgin[i] &= static_cast<BYTE>(~bucket);
+    }
+}
+
+#ifdef BITMAP_X64
+static void mergeSse2(const BYTE* hits, BYTE* virgin, INT32 threadId, std::vector<BitmapUpdate>& updates) {
+    const __m128i zero = _mm_setzero_si128();
+    for (size_t i = 0; i < CoverageBitmap::size; i += sizeof(__m128i)) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hits + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero)) != 0xFFFF)
+            mergeRange(hits, virgin, i, i + sizeof(__m128i), threadId, updates);
+    }
+}
+
+AVX2_TARGET
+static void mergeAvx2(const BYTE* hits, BYTE* virgin, INT32 threadId, std::vector<BitmapUpdate>& updates) {
+    for (size_t i = 0; i < CoverageBitmap::size; i += sizeof(__m256i)) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hits + i));
+        if (!_mm256_testz_si256(block, block))
+            mergeRange(hits, virgin, i, i + sizeof(__m256i), threadId, updates);
+    }
+}
+
+static bool isAvx2Supported() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    // OSXSAVE and AVX, then the OS must save the YMM state
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return false;
+    if ((_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static const bool avx2Supported = isAvx2Supported();
+#else
+static void mergeScalar(const BYTE* hits, BYTE* virgin, INT32 threadId, std::vector<BitmapUpdate>& updates) {
+    for (size_t i = 0; i < CoverageBitmap::size; i += sizeof(UINT64)) {
+        UINT64 word;
+        std::memcpy(&word, hits + i, sizeof(UINT64));
+        if (word != 0)
+            mergeRange(hits, virgin, i, i + sizeof(UINT64), threadId, updates);
+    }
+}
+#endif
+
+//region CoverageBitmap
+void CoverageBitmap::addEdge(UINT32 offset, int methodId) {
+    UINT32 location = (static_cast<UINT32>(methodId) * 0x9E3779B1u ^ offset * 0x85EBCA6Bu) >> 16;
+    // saturating, so an edge hit 256 * k times is not reported as never hit
+    BYTE &hit = hits[location ^ previousLocation];
+    hit += hit != 0xFF;
+    previousLocation = location >> 1;
+}
+//endregion
+
+//region VirginBitmap
+VirginBitmap::VirginBitmap() {
+    reset();
+}
+
+void VirginBitmap::merge(const CoverageBitmap& bitmap, INT32 threadId, std::vector<BitmapUpdate>& updates) {
+#ifdef BITMAP_X64
+    if (avx2Supported)
+        mergeAvx2(bitmap.hits, bits, threadId, updates);
+    else
+        mergeSse2(bitmap.hits, bits, threadId, updates);
+#else
+    mergeScalar(bitmap.hits, bits, threadId, updates);
+#endif
+}
+
+void VirginBitmap::reset() {
+    std::memset(bits, 0xFF, CoverageBitmap::size);
+}
+//endregion
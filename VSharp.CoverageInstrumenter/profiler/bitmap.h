@@ -0,0 +1,41 @@
+#ifndef BITMAP_H_
+#define BITMAP_H_
+
+#include "cor.h"
+#include <vector>
+
+namespace vsharp {
+
+// Hit counts of edges between consecutive coverage points, indexed AFL-style by hashes of (methodId, offset)
+struct CoverageBitmap {
+    static const size_t size = 1 << 16;
+    UINT32 previousLocation;
+    BYTE hits[size];
+
+    void addEdge(UINT32 offset, int methodId);
+};
+
+// Edge of a merged thread bitmap which reached a hit count bucket never seen before
+// NOTE: layout must match 'BitmapUpdate' from VSharp.Utils/CoverageDeserializer.fs
+struct BitmapUpdate {
+    INT32 threadId;
+    UINT32 edge;
+    UINT32 newBuckets;
+    INT32 isNewEdge;
+};
+
+static_assert(sizeof(BitmapUpdate) == 16, "BitmapUpdate must be passed as 16 bytes");
+
+// Buckets of all hit counts seen so far; a set bit means that the bucket was not yet reached by any thread
+class VirginBitmap {
+private:
+    BYTE bits[CoverageBitmap::size];
+public:
+    VirginBitmap();
+    void merge(const CoverageBitmap& bitmap, INT32 threadId, std::vector<BitmapUpdate>& updates);
+    void reset();
+};
+
+}
+
+#endif // BITMAP_H_
@@ -3,10 +3,13 @@
 #include "memory.h"
 #include "cComPtr.h"
 #include "profiler.h"
+#include "methodFilter.h"
 #include "os.h"
 #include <locale>
 #include <string>
 #include <cstring>
+#include <cerrno>
+#include <cstdlib>
 #include <codecvt>
 
 
@@ -20,6 +23,38 @@ void ConvertToWCHAR(const char *str, std::u16string &result) {
     result = conv16.from_bytes(str);
 }
 
+// every line of the file is '<method token> <module path>'
+static void readEntryMethods(const char *path) {
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        auto separator = line.find(' ');
+        if (separator == std::string::npos) {
+            if (!line.empty() && line != "\r")
+                LOG_ERROR(tout << "Malformed entry method is ignored: " << line);
+            continue;
+        }
+        // a malformed line must not throw out of 'Initialize'
+        auto token = line.substr(0, separator);
+        char *tokenEnd = nullptr;
+        errno = 0;
+        unsigned long parsedToken = std::strtoul(token.c_str(), &tokenEnd, 10);
+        bool isNumber = !token.empty() && token.find_first_not_of("0123456789") == std::string::npos;
+        if (!isNumber || errno != 0 || *tokenEnd != '\0') {
+            LOG_ERROR(tout << "Malformed entry method is ignored: " << line);
+            continue;
+        }
+        EntryMethod entry;
+        entry.token = static_cast<mdMethodDef>(parsedToken);
+        auto moduleName = line.substr(separator + 1);
+        if (!moduleName.empty() && moduleName.back() == '\r')
+            moduleName.pop_back();
+        ConvertToWCHAR(moduleName.c_str(), entry.moduleName);
+        entryMethods.push_back(entry);
+    }
+    LOG(tout << "Entry methods of the batch run: " << entryMethods.size());
+}
+
 CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr)
 {
 }
@@ -52,6 +87,8 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
         COR_PRF_DISABLE_OPTIMIZATIONS |
         COR_PRF_MONITOR_EXCEPTIONS |
         COR_PRF_MONITOR_CLR_EXCEPTIONS |
+        COR_PRF_MONITOR_THREADS |
+        COR_PRF_MONITOR_MODULE_LOADS |
         COR_PRF_DISABLE_TRANSPARENCY_CHECKS_UNDER_FULL_TRUST | /* helps the case where this profiler is used on Full CLR */
         COR_PRF_DISABLE_INLINING;
 
@@ -69,6 +106,11 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
 
     InitializeProbes();
     bool collectMainOnly = false;
+    // edge hit counts are collected instead of the full event trace
+    bool collectBitmap = std::getenv("COVERAGE_BITMAP_MODE") != nullptr;
+    if (collectBitmap) {
+        LOG(tout << "COLLECTING COVERAGE BITMAPS" << std::endl);
+    }
     // reading environment variables to determine the running mode
     if (isPassive != nullptr) {
         LOG(tout << "WORKING IN PASSIVE MODE" << std::endl);
@@ -76,32 +118,55 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
         isPassiveRun = true;
         collectMainOnly = true;
 
-        std::u16string assemblyNameU16;
-        std::u16string moduleNameU16;
-
-        // setting up entry main
-        ConvertToWCHAR(std::getenv("COVERAGE_METHOD_ASSEMBLY_NAME"), assemblyNameU16);
-        ConvertToWCHAR(std::getenv("COVERAGE_METHOD_MODULE_NAME"), moduleNameU16);
-        mainToken = std::stoi(std::getenv("COVERAGE_METHOD_TOKEN"));
-
-        mainAssemblyNameLength = assemblyNameU16.size();
-        mainAssemblyName = new WCHAR[mainAssemblyNameLength];
-        memcpy(mainAssemblyName, assemblyNameU16.data(), mainAssemblyNameLength * sizeof(WCHAR));
-
-        mainModuleNameLength = moduleNameU16.size();
-        mainModuleName = new WCHAR[mainModuleNameLength];
-        memcpy(mainModuleName, moduleNameU16.data(), mainModuleNameLength * sizeof(WCHAR));
-
         passiveResultPath = std::getenv("COVERAGE_RESULT_NAME");
 
+        const char* entryMethodsPath = std::getenv("COVERAGE_ENTRY_METHODS_FILE");
+        if (entryMethodsPath != nullptr) {
+            // batch run: the test runner reports the boundaries of each test via 'BeginTest' and 'EndTest'
+            LOG(tout << "WORKING IN BATCH MODE" << std::endl);
+            readEntryMethods(entryMethodsPath);
+            if (!openBatchReports(passiveResultPath)) {
+                LOG(tout << "Batch reports file can not be opened: " << passiveResultPath);
+            }
+        } else {
+            // setting up entry main
+            auto main = new EntryMethod();
+            ConvertToWCHAR(std::getenv("COVERAGE_METHOD_MODULE_NAME"), main->moduleName);
+            main->token = std::stoi(std::getenv("COVERAGE_METHOD_TOKEN"));
+            setEntryMain(main);
+        }
+
         if (std::getenv("COVERAGE_INSTRUMENT_MAIN_ONLY")) {
             rewriteMainOnly = true;
+
+            // no other method is rewritten, so counters of main do not need tracking of threads and stack balances
+            if (std::getenv("COVERAGE_INLINE_COUNTERS") && !collectBitmap) {
+                LOG(tout << "USING INLINE COUNTERS" << std::endl);
+                rewriteWithCounters = true;
+            }
         }
     }
 
+    const char* ilCacheDirectory = std::getenv("COVERAGE_IL_CACHE_DIR");
+    if (ilCacheDirectory != nullptr) {
+        std::string buildId;
+        if (readProfilerBuildId(buildId)) {
+            LOG(tout << "CACHING REWRITTEN IL IN " << ilCacheDirectory << std::endl);
+            ilCache = new ILCache(ilCacheDirectory, buildId);
+        } else {
+            LOG_ERROR(tout << "Profiler image can not be read, IL caching is disabled");
+        }
+    }
+
+    methodFilter = loadMethodFilter();
+    if (methodFilter != nullptr) {
+        LOG(tout << "FILTERING INSTRUMENTED METHODS BY " << methodFilter->rulesCount() << " RULES" << std::endl);
+    }
+
+    instrumenter = new Instrumenter(*corProfilerInfo);
     threadInfo = new ThreadInfo(corProfilerInfo);
     threadTracker = new ThreadTracker();
-    coverageTracker = new CoverageTracker(collectMainOnly);
+    coverageTracker = new CoverageTracker(collectMainOnly, collectBitmap);
 
     LOG(tout << "Initialize finished" << std::endl);
     return S_OK;
@@ -115,10 +180,16 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Shutdown()
     while (std::atomic_load(&shutdownBlockingRequestsCount) > 0) {}
 
     LOG(tout << "SHUTDOWN");
-    if (isPassiveRun) {
+    if (isBatchRun()) {
+        // reports were already written at the end of each test
+        closeBatchReports();
+    } else if (isPassiveRun) {
+
+        if (rewriteWithCounters)
+            coverageTracker->collectCounters();
 
         size_t tmpSize;
-        auto tmpBytes = coverageTracker->serializeCoverageReport(&tmpSize);;
+        auto tmpBytes = coverageTracker->serializeCoverageReport(&tmpSize);
 
         std::ofstream fout;
         fout.open(passiveResultPath, std::ios::out|std::ios::binary);
@@ -130,8 +201,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Shutdown()
     close_log();
 #endif
 
-    delete[] mainModuleName;
-    delete[] mainAssemblyName;
+    releaseEntryMains();
 
     if (this->corProfilerInfo != nullptr)
     {
@@ -202,14 +272,18 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadStarted(ModuleID moduleId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadFinished(ModuleID moduleId, HRESULT hrStatus)
 {
-    UNUSED(moduleId);
-    UNUSED(hrStatus);
+    if (FAILED(hrStatus) || isFinished) return S_OK;
+    HRESULT hr = instrumenter->moduleLoaded(moduleId);
+    if (FAILED(hr)) {
+        // the module is read again at the first JIT of its methods
+        LOG(tout << "metadata of module " << moduleId << " is not available on load: " << std::hex << hr);
+    }
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadStarted(ModuleID moduleId)
 {
-    UNUSED(moduleId);
+    instrumenter->moduleUnloaded(moduleId);
     return S_OK;
 }
 
@@ -267,9 +341,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID function
     std::atomic_fetch_add(&shutdownBlockingRequestsCount, 1);
 
     UNUSED(fIsSafeToBlock);
-    auto instrument = new Instrumenter(*corProfilerInfo);
-    HRESULT hr = instrument->instrument(functionId);
-    delete instrument;
+    HRESULT hr = instrumenter->instrument(functionId);
 
     std::atomic_fetch_sub(&shutdownBlockingRequestsCount, 1);
     return hr;
@@ -314,12 +386,17 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITInlining(FunctionID callerId, Function
 HRESULT STDMETHODCALLTYPE CorProfiler::ThreadCreated(ThreadID threadId)
 {
     UNUSED(threadId);
+    if (threadInfo != nullptr)
+        threadInfo->invalidateCache();
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ThreadDestroyed(ThreadID threadId)
 {
-    UNUSED(threadId);
+    if (threadInfo != nullptr) {
+        threadInfo->invalidateCache();
+        threadStoragesThreadDestroyed(threadId);
+    }
     return S_OK;
 }
 
@@ -327,6 +404,8 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ThreadAssignedToOSThread(ThreadID managed
 {
     UNUSED(managedThreadId);
     UNUSED(osThreadId);
+    if (threadInfo != nullptr)
+        threadInfo->invalidateCache();
     return S_OK;
 }
 
@@ -13,6 +13,7 @@ class CorProfiler : public ICorProfilerCallback8
 private:
     std::atomic<int> refCount;
     ICorProfilerInfo8 *corProfilerInfo;
+    Instrumenter *instrumenter = nullptr;
     char *passiveResultPath = nullptr;
     bool isPassiveRun = false;
     bool isFinished = false;
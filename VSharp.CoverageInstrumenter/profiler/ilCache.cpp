@@ -0,0 +1,179 @@
+#include "ilCache.h"
+#include "logging.h"
+#include "os.h"
+#include <cstdio>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+using namespace vsharp;
+
+ILCache* vsharp::ilCache = nullptr;
+
+static const UINT32 cacheMagic = 0x4C495356; // "VSIL"
+
+// must be incremented when the layout of the entries, of the relocations or of the probes table is changed
+static const UINT32 cacheFormatVersion = 2;
+
+bool vsharp::readProfilerBuildId(std::string &buildId) {
+    std::string imagePath = OS::profilerImagePath();
+    std::ifstream image(imagePath, std::ios::in | std::ios::binary);
+    if (imagePath.empty() || !image.is_open())
+        return false;
+
+    // FNV-1a
+    UINT64 hash = 0xcbf29ce484222325ull;
+    char chunk[64 * 1024];
+    while (image) {
+        image.read(chunk, sizeof(chunk));
+        for (std::streamsize i = 0; i < image.gcount(); i++) {
+            hash ^= static_cast<BYTE>(chunk[i]);
+            hash *= 0x100000001b3ull;
+        }
+    }
+    if (image.bad())
+        return false;
+
+    std::stringstream id;
+    id << cacheFormatVersion << '_' << std::hex << hash;
+    buildId = id.str();
+    return true;
+}
+
+UINT32 vsharp::relocationSize(UINT32 kind) {
+    return kind == ProbeAddressRelocation || kind == CounterRelocation ? sizeof(size_t) : sizeof(INT32);
+}
+
+template<typename T>
+static void writePrimitive(std::ofstream &out, const T &value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+static void writeVector(std::ofstream &out, const std::vector<T> &values) {
+    writePrimitive(out, static_cast<UINT32>(values.size()));
+    out.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(T)));
+}
+
+template<typename T>
+static bool readPrimitive(std::ifstream &in, T &value) {
+    in.read(reinterpret_cast<char*>(&value), sizeof(T));
+    return in.gcount() == sizeof(T);
+}
+
+template<typename T>
+static bool readVector(std::ifstream &in, std::vector<T> &values) {
+    UINT32 size;
+    if (!readPrimitive(in, size))
+        return false;
+    values.resize(size);
+    auto bytes = static_cast<std::streamsize>(size * sizeof(T));
+    in.read(reinterpret_cast<char*>(values.data()), bytes);
+    return in.gcount() == bytes;
+}
+
+// the directory may contain truncated or foreign files, and a bad relocation would crash the target process
+static bool isValidEntry(const CachedILBody &entry) {
+    for (auto &relocation : entry.relocations) {
+        bool inBounds = relocation.position <= entry.body.size()
+            && relocationSize(relocation.kind) <= entry.body.size() - relocation.position;
+        if (!inBounds)
+            return false;
+        switch (relocation.kind) {
+            case ProbeAddressRelocation:
+            case ProbeSignatureRelocation:
+                if (relocation.argument >= relocatableProbesCount)
+                    return false;
+                break;
+            case CounterRelocation:
+                if (relocation.argument >= entry.countersCount)
+                    return false;
+                break;
+            case MethodIdRelocation:
+                break;
+            default:
+                return false;
+        }
+    }
+    for (auto &point : entry.counterPoints) {
+        if (point.counter >= entry.countersCount)
+            return false;
+    }
+    return true;
+}
+
+ILCache::ILCache(const char *directory, std::string buildId) : directory(directory), buildId(std::move(buildId)) {
+    if (!this->directory.empty() && this->directory.back() != '/' && this->directory.back() != '\\')
+        this->directory.push_back('/');
+}
+
+std::string ILCache::entryPath(const GUID &mvid, mdMethodDef method, unsigned mode) const {
+    std::stringstream name;
+    name << directory << std::hex;
+    auto mvidBytes = reinterpret_cast<const BYTE*>(&mvid);
+    for (size_t i = 0; i < sizeof(GUID); i++)
+        name << (mvidBytes[i] >> 4) << (mvidBytes[i] & 0xF);
+    name << '_' << method << '_' << mode << ".il";
+    return name.str();
+}
+
+bool ILCache::load(const GUID &mvid, mdMethodDef method, unsigned mode, CachedILBody &entry) const {
+    std::ifstream in(entryPath(mvid, method, mode), std::ios::in | std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    UINT32 magic;
+    std::vector<char> entryBuildId;
+    bool valid =
+        readPrimitive(in, magic) && magic == cacheMagic
+        && readVector(in, entryBuildId) && std::string(entryBuildId.begin(), entryBuildId.end()) == buildId
+        && readVector(in, entry.body)
+        && readVector(in, entry.relocations)
+        && readPrimitive(in, entry.countersCount)
+        && readVector(in, entry.counterPoints);
+    if (!valid) {
+        LOG(tout << "IL cache entry of method " << method << " is stale or broken");
+        return false;
+    }
+
+    if (!isValidEntry(entry)) {
+        LOG(tout << "IL cache entry of method " << method << " has invalid relocations");
+        return false;
+    }
+    return true;
+}
+
+void ILCache::store(const GUID &mvid, mdMethodDef method, unsigned mode, const CachedILBody &entry) const {
+    if (!isValidEntry(entry)) {
+        LOG(tout << "IL of method " << method << " references unknown probes or counters, it is not cached");
+        return;
+    }
+
+    auto path = entryPath(mvid, method, mode);
+    // concurrent processes write their own temporary files, so readers never observe partially written entries
+    std::stringstream tmpPath;
+    tmpPath << path << ".tmp" << std::hex
+            << std::hash<std::thread::id>()(std::this_thread::get_id())
+            << std::chrono::steady_clock::now().time_since_epoch().count();
+
+    std::ofstream out(tmpPath.str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        LOG(tout << "IL cache entry of method " << method << " can not be written to " << tmpPath.str());
+        return;
+    }
+    writePrimitive(out, cacheMagic);
+    writeVector(out, std::vector<char>(buildId.begin(), buildId.end()));
+    writeVector(out, entry.body);
+    writeVector(out, entry.relocations);
+    writePrimitive(out, entry.countersCount);
+    writeVector(out, entry.counterPoints);
+    out.close();
+
+    if (out.fail() || std::rename(tmpPath.str().c_str(), path.c_str()) != 0) {
+        // the entry may be already published by another process
+        std::remove(tmpPath.str().c_str());
+    }
+}
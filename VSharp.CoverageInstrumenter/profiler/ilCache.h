@@ -0,0 +1,66 @@
+#ifndef ILCACHE_H_
+#define ILCACHE_H_
+
+#include "cor.h"
+#include <string>
+#include <vector>
+
+namespace vsharp {
+
+// Operands of the rewritten IL which differ between processes, so they are patched when the body is taken from the cache
+enum ILRelocationKind {
+    NoRelocation,
+    ProbeAddressRelocation,     // argument is the index of the probe
+    ProbeSignatureRelocation,   // argument is the index of the probe
+    MethodIdRelocation,
+    CounterRelocation           // argument is the index of the counter in the method's slab
+};
+
+struct ILRelocation {
+    UINT32 position; // from the beginning of the method body
+    UINT32 kind;
+    UINT32 argument;
+};
+
+// number of probes which may be referenced by relocations, defined next to their table
+extern const UINT32 relocatableProbesCount;
+
+// addresses are loaded with native-sized constants, the rest are 4-byte operands
+UINT32 relocationSize(UINT32 kind);
+
+struct CachedCounterPoint {
+    UINT32 offset;
+    INT32 event;
+    UINT32 counter;
+};
+
+struct CachedILBody {
+    std::vector<BYTE> body;
+    std::vector<ILRelocation> relocations;
+    UINT32 countersCount = 0;
+    std::vector<CachedCounterPoint> counterPoints;
+};
+
+// Rewritten method bodies stored on disk, one file per (module MVID, method token, instrumentation mode)
+class ILCache {
+private:
+    std::string directory;
+    std::string buildId;
+
+    std::string entryPath(const GUID &mvid, mdMethodDef method, unsigned mode) const;
+public:
+    ILCache(const char *directory, std::string buildId);
+    bool load(const GUID &mvid, mdMethodDef method, unsigned mode, CachedILBody &entry) const;
+    void store(const GUID &mvid, mdMethodDef method, unsigned mode, const CachedILBody &entry) const;
+};
+
+// Entries written by another build of the profiler may place probes differently, so they are never reused:
+// the id is the hash of the loaded profiler image and of the entry format version; 'false' if the image can not be read
+bool readProfilerBuildId(std::string &buildId);
+
+// nullptr if caching is disabled
+extern ILCache *ilCache;
+
+}
+
+#endif // ILCACHE_H_
@@ -2,6 +2,8 @@
 #include "logging.h"
 #include "cComPtr.h"
 #include "os.h"
+#include <algorithm>
+#include <fstream>
 #include <vector>
 
 
@@ -10,33 +12,64 @@ using namespace vsharp;
 #define TOKENPASTE(x, y) x ## y
 #define TOKENPASTE2(x, y) TOKENPASTE(x, y)
 #define UNIQUE TOKENPASTE2(Sig, __LINE__)
-#define SIG_DEF(...) \
+#define SIG_DEF(KIND, ...) \
     constexpr COR_SIGNATURE UNIQUE[] = {IMAGE_CEE_CS_CALLCONV_STDCALL, __VA_ARGS__};\
-    IfFailRet(metadataEmit->GetTokenFromSig(UNIQUE, sizeof(UNIQUE), &signatureToken));\
-    tokens.push_back(signatureToken);
+    IfFailRet(metadataEmit->GetTokenFromSig(UNIQUE, sizeof(UNIQUE), &signatures.tokens[KIND]));
 
 #define ELEMENT_TYPE_COND ELEMENT_TYPE_I
 #define ELEMENT_TYPE_TOKEN ELEMENT_TYPE_U4
 #define ELEMENT_TYPE_OFFSET ELEMENT_TYPE_I4
 #define ELEMENT_TYPE_SIZE ELEMENT_TYPE_U
 
-WCHAR* vsharp::mainAssemblyName = nullptr;
-int vsharp::mainAssemblyNameLength = 0;
-WCHAR* vsharp::mainModuleName = nullptr;
-int vsharp::mainModuleNameLength = 0;
-mdMethodDef vsharp::mainToken = 0;
 bool vsharp::rewriteMainOnly = false;
+bool vsharp::rewriteWithCounters = false;
+std::vector<EntryMethod> vsharp::entryMethods;
 
-extern "C" void SetEntryMain(char* assemblyName, int assemblyNameLength, char* moduleName, int moduleNameLength, int methodToken) {
-    mainAssemblyNameLength = assemblyNameLength;
-    mainAssemblyName = new WCHAR[assemblyNameLength];
-    memcpy(mainAssemblyName, assemblyName, assemblyNameLength * sizeof(WCHAR));
+static std::atomic<const EntryMethod*> entryMain(nullptr);
+static std::vector<const EntryMethod*> replacedEntryMains;
+static std::mutex replacedEntryMainsMutex;
+
+void vsharp::setEntryMain(const EntryMethod *main) {
+    const EntryMethod *replaced = entryMain.exchange(main, std::memory_order_acq_rel);
+    if (replaced == nullptr)
+        return;
+    // a JIT thread may still be reading the replaced entry
+    std::lock_guard<std::mutex> lock(replacedEntryMainsMutex);
+    replacedEntryMains.push_back(replaced);
+}
+
+void vsharp::releaseEntryMains() {
+    std::lock_guard<std::mutex> lock(replacedEntryMainsMutex);
+    for (auto main : replacedEntryMains)
+        delete main;
+    replacedEntryMains.clear();
+    delete entryMain.exchange(nullptr, std::memory_order_acq_rel);
+}
+
+static std::ofstream batchReports;
+static std::mutex batchReportsMutex;
+
+bool vsharp::openBatchReports(const char *path) {
+    batchReports.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    return batchReports.is_open();
+}
 
-    mainModuleNameLength = moduleNameLength;
-    mainModuleName = new WCHAR[moduleNameLength];
-    memcpy(mainModuleName, moduleName, moduleNameLength * sizeof(WCHAR));
+bool vsharp::isBatchRun() {
+    return batchReports.is_open();
+}
 
-    mainToken = methodToken;
+void vsharp::closeBatchReports() {
+    std::lock_guard<std::mutex> lock(batchReportsMutex);
+    batchReports.close();
+}
+
+extern "C" void SetEntryMain(char* assemblyName, int assemblyNameLength, char* moduleName, int moduleNameLength, int methodToken) {
+    (void) assemblyName;
+    (void) assemblyNameLength;
+    auto main = new EntryMethod();
+    main->token = methodToken;
+    main->moduleName.assign(reinterpret_cast<const char16_t*>(moduleName), moduleNameLength);
+    setEntryMain(main);
 
     LOG(tout << "received entry main" << std::endl);
 }
@@ -56,132 +89,323 @@ extern "C" void GetHistory(UINT_PTR size, UINT_PTR bytes) {
     LOG(tout << "GetHistory request handled!");
 }
 
+extern "C" void GetHistoryView(UINT_PTR methodsSize, UINT_PTR methodsBytes, UINT_PTR descriptorsCount, UINT_PTR descriptors) {
+    LOG(tout << "GetHistoryView request received! publishing coverage chunks");
+
+    if (coverageTracker->isCollectBitmap()) {
+        // bitmap histories have no records, reporting them as empty traces would silently lose the coverage
+        LOG_ERROR(tout << "GetHistoryView is not available in the bitmap mode, use GetHistory or MergeCoverageBitmaps");
+        profiler_assert(false);
+        *(ULONG*)methodsSize = 0;
+        *(char**)methodsBytes = nullptr;
+        *(ULONG*)descriptorsCount = 0;
+        *(CoverageChunkDescriptor**)descriptors = nullptr;
+        return;
+    }
+
+    std::atomic_fetch_add(&shutdownBlockingRequestsCount, 1);
+    char *methods;
+    size_t tmpMethodsSize;
+    CoverageChunkDescriptor *chunks;
+    size_t tmpChunksCount;
+    coverageTracker->publishCoverageView(&methods, &tmpMethodsSize, &chunks, &tmpChunksCount);
+    *(ULONG*)methodsSize = tmpMethodsSize;
+    *(char**)methodsBytes = methods;
+    *(ULONG*)descriptorsCount = tmpChunksCount;
+    *(CoverageChunkDescriptor**)descriptors = chunks;
+
+    threadTracker->clear();
+    std::atomic_fetch_sub(&shutdownBlockingRequestsCount, 1);
+    LOG(tout << "GetHistoryView request handled!");
+}
+
+extern "C" void ReleaseHistoryView() {
+    LOG(tout << "ReleaseHistoryView request received!");
+    std::atomic_fetch_add(&shutdownBlockingRequestsCount, 1);
+    coverageTracker->releaseCoverageView();
+    std::atomic_fetch_sub(&shutdownBlockingRequestsCount, 1);
+}
+
+extern "C" void MergeCoverageBitmaps(UINT_PTR updatesCount, UINT_PTR updates) {
+    LOG(tout << "MergeCoverageBitmaps request received!");
+
+    std::atomic_fetch_add(&shutdownBlockingRequestsCount, 1);
+    BitmapUpdate *tmpUpdates;
+    size_t tmpCount;
+    coverageTracker->mergeBitmaps(&tmpUpdates, &tmpCount);
+    *(ULONG*)updatesCount = tmpCount;
+    *(BitmapUpdate**)updates = tmpUpdates;
+
+    threadTracker->clear();
+    std::atomic_fetch_sub(&shutdownBlockingRequestsCount, 1);
+    LOG(tout << "MergeCoverageBitmaps request handled!");
+}
+
 extern "C" void SetCurrentThreadId(int mapId) {
     LOG(tout << "Map current thread to: " << mapId);
     threadTracker->mapCurrentThread(mapId);
 }
 
+extern "C" void BeginTest(int testId) {
+    (void) testId;
+    LOG(tout << "BeginTest request received! test " << testId);
+
+    std::atomic_fetch_add(&shutdownBlockingRequestsCount, 1);
+    // coverage of the previous tests and of the test runner itself is not reported
+    coverageTracker->clear();
+    threadTracker->clear();
+    if (rewriteWithCounters)
+        coverageTracker->resetCounters();
+    std::atomic_fetch_sub(&shutdownBlockingRequestsCount, 1);
+}
+
+extern "C" void EndTest(int testId) {
+    LOG(tout << "EndTest request received! writing the report of test " << testId);
+
+    std::atomic_fetch_add(&shutdownBlockingRequestsCount, 1);
+    if (rewriteWithCounters)
+        coverageTracker->collectCounters();
+    size_t tmpSize;
+    auto tmpBytes = coverageTracker->serializeCoverageReport(&tmpSize);
+    threadTracker->clear();
+
+    {
+        std::lock_guard<std::mutex> lock(batchReportsMutex);
+        if (batchReports.is_open()) {
+            auto size = static_cast<int>(tmpSize);
+            batchReports.write(reinterpret_cast<const char*>(&testId), sizeof(int));
+            batchReports.write(reinterpret_cast<const char*>(&size), sizeof(int));
+            batchReports.write(tmpBytes, static_cast<std::streamsize>(tmpSize));
+            batchReports.flush();
+        }
+    }
+    delete[] tmpBytes;
+
+    std::atomic_fetch_sub(&shutdownBlockingRequestsCount, 1);
+    LOG(tout << "EndTest request handled!");
+}
+
 extern "C" void SetStackBottom() {
     LOG(tout << "Bottom marker was set");
     int stackBottomMarker;
     stackBottom = (size_t) &stackBottomMarker;
 }
 
-std::set<std::pair<FunctionID, ModuleID>> vsharp::instrumentedMethods;
-
-HRESULT initTokens(const CComPtr<IMetaDataEmit> &metadataEmit, std::vector<mdSignature> &tokens) {
-    auto covProb = getProbes();
-    mdSignature signatureToken;
-    SIG_DEF(0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_OFFSET)
-    covProb->Finalize_Call->setSig(signatureToken);
-    SIG_DEF(0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_OFFSET, ELEMENT_TYPE_I4)
-    covProb->Branch->setSig(signatureToken);
-    covProb->Call->setSig(signatureToken);
-    covProb->Leave->setSig(signatureToken);
-    covProb->Throw->setSig(signatureToken);
-    covProb->Stsfld->setSig(signatureToken);
-    covProb->Coverage->setSig(signatureToken);
-    covProb->Tailcall->setSig(signatureToken);
-    covProb->LeaveMain->setSig(signatureToken);
-    SIG_DEF(0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_OFFSET, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4)
-    covProb->EnterMain->setSig(signatureToken);
-    covProb->Enter->setSig(signatureToken);
+ShardedMap<std::pair<mdMethodDef, ModuleID>, size_t, MethodKeyHash> vsharp::instrumentedMethods;
+
+HRESULT initTokens(const CComPtr<IMetaDataEmit> &metadataEmit, ProbeSignatures &signatures) {
+    SIG_DEF(OffsetSignature, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_OFFSET)
+    SIG_DEF(OffsetIdSignature, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_OFFSET, ELEMENT_TYPE_I4)
+    SIG_DEF(OffsetIdIdSignature, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_OFFSET, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4)
     return S_OK;
 }
 
 Instrumenter::Instrumenter(ICorProfilerInfo8 &profilerInfo)
     : m_profilerInfo(profilerInfo)
-    , m_moduleId(0)
-    , m_signatureTokens(nullptr)
 {
 }
 
-Instrumenter::~Instrumenter()
-{
-    delete[] m_signatureTokens;
+static bool isEntryMethod(const EntryMethod &entry, const std::vector<WCHAR> &moduleName, mdMethodDef method) {
+    // NOTE: decrementing the size, because of null terminator
+    if (entry.token != method || entry.moduleName.size() != moduleName.size() - 1)
+        return false;
+    return std::equal(entry.moduleName.begin(), entry.moduleName.end(), moduleName.begin(),
+                      [](char16_t expected, WCHAR actual) { return expected == static_cast<char16_t>(actual); });
 }
 
+bool Instrumenter::currentMethodIsMain(const ModuleNames &names, mdMethodDef method) const {
+    for (auto &entry : entryMethods) {
+        if (isEntryMethod(entry, names.moduleName, method))
+            return true;
+    }
+    const EntryMethod *main = entryMain.load(std::memory_order_acquire);
+    return main != nullptr && isEntryMethod(*main, names.moduleName, method);
+}
 
-bool Instrumenter::currentMethodIsMain(const WCHAR *moduleName, int moduleSize, mdMethodDef method) const {
-    // NOTE: decrementing 'moduleSize', because of null terminator
-    if (mainModuleName == nullptr)
-        return false;
-    if (mainModuleNameLength != moduleSize - 1 || mainToken != method)
+HRESULT Instrumenter::readModuleNames(ModuleID moduleId, ModuleMetadata &module) {
+    auto names = std::make_shared<ModuleNames>();
+    LPCBYTE baseLoadAddress;
+    ULONG moduleNameLength;
+    AssemblyID assembly;
+    IfFailRet(m_profilerInfo.GetModuleInfo(moduleId, &baseLoadAddress, 0, &moduleNameLength, nullptr, &assembly));
+    names->moduleName.resize(moduleNameLength);
+    IfFailRet(m_profilerInfo.GetModuleInfo(moduleId, &baseLoadAddress, moduleNameLength, &moduleNameLength, names->moduleName.data(), &assembly));
+    ULONG assemblyNameLength;
+    AppDomainID appDomainId;
+    ModuleID startModuleId;
+    IfFailRet(m_profilerInfo.GetAssemblyInfo(assembly, 0, &assemblyNameLength, nullptr, &appDomainId, &startModuleId));
+    names->assemblyName.resize(assemblyNameLength);
+    IfFailRet(m_profilerInfo.GetAssemblyInfo(assembly, assemblyNameLength, &assemblyNameLength, names->assemblyName.data(), &appDomainId, &startModuleId));
+
+    module.names = names;
+    if (methodFilter != nullptr) {
+        // NOTE: decrementing the size, because of null terminator
+        module.filter = methodFilter->forAssembly(toUtf8(names->assemblyName.data(), names->assemblyName.size() - 1));
+    }
+    return S_OK;
+}
+
+// Opens the module for writing and emits the probe signatures into it
+HRESULT Instrumenter::readRewriteMetadata(ModuleID moduleId, ModuleMetadata &module) {
+    IfFailRet(m_profilerInfo.GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&module.metadataImport)));
+    IfFailRet(module.metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void **>(&module.metadataEmit)));
+    IfFailRet(initTokens(module.metadataEmit, module.signatures));
+    IfFailRet(module.metadataImport->GetScopeProps(nullptr, 0, nullptr, &module.mvid));
+    return S_OK;
+}
+
+HRESULT Instrumenter::readModuleMetadata(ModuleID moduleId, std::shared_ptr<const ModuleMetadata> &module) {
+    auto metadata = std::make_shared<ModuleMetadata>();
+    IfFailRet(readModuleNames(moduleId, *metadata));
+    // only a few modules contain entry methods, the others are never rewritten
+    if (!rewriteMainOnly && metadata->filter.assemblyDecision() != MethodFilter::Excluded)
+        IfFailRet(readRewriteMetadata(moduleId, *metadata));
+    module = metadata;
+    return S_OK;
+}
+
+// Reads the rest of the metadata of the module, when the first of its methods is rewritten
+HRESULT Instrumenter::completeModuleMetadata(ModuleID moduleId, std::shared_ptr<const ModuleMetadata> &module) {
+    auto metadata = std::make_shared<ModuleMetadata>();
+    metadata->names = module->names;
+    metadata->filter = module->filter;
+    IfFailRet(readRewriteMetadata(moduleId, *metadata));
+    std::shared_ptr<const ModuleMetadata> completed = metadata;
+    // another JIT thread may have completed it first, then its signatures are used
+    m_modules.replace(moduleId, module, completed);
+    module = completed;
+    return S_OK;
+}
+
+HRESULT Instrumenter::moduleLoaded(ModuleID moduleId) {
+    std::shared_ptr<const ModuleMetadata> module;
+    IfFailRet(readModuleMetadata(moduleId, module));
+    m_modules.findOrAdd(moduleId, [&module]() { return module; }, module);
+    return S_OK;
+}
+
+void Instrumenter::moduleUnloaded(ModuleID moduleId) {
+    m_modules.erase(moduleId);
+    // methods of a module loaded later with the same id must be rewritten again
+    instrumentedMethods.eraseIf([moduleId](const std::pair<mdMethodDef, ModuleID> &method, size_t) {
+        return method.second == moduleId;
+    });
+}
+
+HRESULT Instrumenter::getModuleMetadata(ModuleID moduleId, std::shared_ptr<const ModuleMetadata> &module) {
+    if (m_modules.find(moduleId, module))
+        return S_OK;
+    // the metadata of some modules is not available yet when they are loaded
+    IfFailRet(readModuleMetadata(moduleId, module));
+    m_modules.findOrAdd(moduleId, [&module]() { return module; }, module);
+    return S_OK;
+}
+
+static HRESULT getTypeName(IMetaDataImport &metadataImport, mdTypeDef type, std::string &name) {
+    WCHAR typeName[MAX_CLASS_NAME];
+    ULONG typeNameLength;
+    IfFailRet(metadataImport.GetTypeDefProps(type, typeName, MAX_CLASS_NAME, &typeNameLength, nullptr, nullptr));
+    name = toUtf8(typeName, typeNameLength);
+    mdTypeDef enclosingType;
+    if (SUCCEEDED(metadataImport.GetNestedClassProps(type, &enclosingType))) {
+        std::string enclosingName;
+        IfFailRet(getTypeName(metadataImport, enclosingType, enclosingName));
+        name = enclosingName + "+" + name;
+    }
+    return S_OK;
+}
+
+bool Instrumenter::isFilteredOut(const ModuleMetadata &module, mdMethodDef method) const {
+    switch (module.filter.assemblyDecision()) {
+        case MethodFilter::Excluded:
+            return true;
+        case MethodFilter::Included:
+            return false;
+        default:
+            break;
+    }
+    WCHAR methodName[MAX_CLASS_NAME];
+    ULONG methodNameLength;
+    mdTypeDef type;
+    std::string typeName;
+    if (FAILED(module.metadataImport->GetMethodProps(method, &type, methodName, MAX_CLASS_NAME, &methodNameLength, nullptr, nullptr, nullptr, nullptr, nullptr))
+        || FAILED(getTypeName(*module.metadataImport, type, typeName))) {
+        LOG_ERROR(tout << "Name of method " << method << " can not be read, it is not filtered");
         return false;
-    for (int i = 0; i < mainModuleNameLength; i++)
-        if (mainModuleName[i] != moduleName[i]) return false;
-    return true;
-}
-
-HRESULT Instrumenter::doInstrumentation(ModuleID oldModuleId, size_t methodId, const WCHAR *moduleName, ULONG moduleNameLength) {
-    HRESULT hr;
-    CComPtr<IMetaDataImport> metadataImport;
-    CComPtr<IMetaDataEmit> metadataEmit;
-    IfFailRet(m_profilerInfo.GetModuleMetaData(m_moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
-    IfFailRet(metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void **>(&metadataEmit)));
-
-    if (oldModuleId != m_moduleId) {
-        delete[] m_signatureTokens;
-        std::vector<mdSignature> tokens;
-        initTokens(metadataEmit, tokens);
-        m_signatureTokensLength = tokens.size() * sizeof(mdSignature);
-        m_signatureTokens = new char[m_signatureTokensLength];
-        memcpy(m_signatureTokens, (char *)&tokens[0], m_signatureTokensLength);
     }
+    return !module.filter.matches(typeName, toUtf8(methodName, methodNameLength));
+}
+
+// Installs the probe signatures of the module for the current thread, while the method is rewritten
+class ProbeSignaturesScope {
+public:
+    explicit ProbeSignaturesScope(const ProbeSignatures *signatures) { setCurrentProbeSignatures(signatures); }
+    ~ProbeSignaturesScope() { setCurrentProbeSignatures(nullptr); }
+};
 
-    RewriteIL(&m_profilerInfo, nullptr, m_moduleId, m_jittedToken, methodId, currentMethodIsMain(moduleName, moduleNameLength, m_jittedToken), rewriteMainOnly);
+HRESULT Instrumenter::doInstrumentation(ModuleID moduleId, const ModuleMetadata &module, mdMethodDef method, size_t methodId) {
+    ProbeSignaturesScope signaturesScope(&module.signatures);
+
+    bool isMain = currentMethodIsMain(*module.names, method);
+    if (ilCache == nullptr) {
+        RewriteIL(&m_profilerInfo, nullptr, moduleId, method, methodId, isMain, rewriteMainOnly, rewriteWithCounters);
+        return S_OK;
+    }
+
+    // rewritten bodies of the same module version are reused across processes
+    unsigned mode = (isMain ? 1 : 0) | (rewriteMainOnly ? 2 : 0) | (rewriteWithCounters ? 4 : 0);
+    CachedILBody cached;
+    if (ilCache->load(module.mvid, method, mode, cached)
+        && SUCCEEDED(ApplyCachedIL(&m_profilerInfo, moduleId, method, methodId, cached))) {
+        LOG(tout << "IL of method " << method << " is taken from the cache");
+        return S_OK;
+    }
+
+    CachedILBody exported;
+    if (SUCCEEDED(RewriteIL(&m_profilerInfo, nullptr, moduleId, method, methodId, isMain, rewriteMainOnly, rewriteWithCounters, &exported)))
+        ilCache->store(module.mvid, method, mode, exported);
 
     return S_OK;
 }
 
 HRESULT Instrumenter::instrument(FunctionID functionId) {
-    HRESULT hr = S_OK;
-    ModuleID newModuleId;
+    ModuleID moduleId;
     ClassID classId;
-    IfFailRet(m_profilerInfo.GetFunctionInfo(functionId, &classId, &newModuleId, &m_jittedToken));
-    assert((m_jittedToken & 0xFF000000L) == mdtMethodDef);
+    mdMethodDef method;
+    IfFailRet(m_profilerInfo.GetFunctionInfo(functionId, &classId, &moduleId, &method));
+    assert((method & 0xFF000000L) == mdtMethodDef);
 
-    LPCBYTE baseLoadAddress;
-    ULONG moduleNameLength;
-    AssemblyID assembly;
-    IfFailRet(m_profilerInfo.GetModuleInfo(newModuleId, &baseLoadAddress, 0, &moduleNameLength, nullptr, &assembly));
-    WCHAR *moduleName = new WCHAR[moduleNameLength];
-    IfFailRet(m_profilerInfo.GetModuleInfo(newModuleId, &baseLoadAddress, moduleNameLength, &moduleNameLength, moduleName, &assembly));
-    ULONG assemblyNameLength;
-    AppDomainID appDomainId;
-    ModuleID startModuleId;
-    IfFailRet(m_profilerInfo.GetAssemblyInfo(assembly, 0, &assemblyNameLength, nullptr, &appDomainId, &startModuleId));
-    WCHAR *assemblyName = new WCHAR[assemblyNameLength];
-    IfFailRet(m_profilerInfo.GetAssemblyInfo(assembly, assemblyNameLength, &assemblyNameLength, assemblyName, &appDomainId, &startModuleId));
+    std::shared_ptr<const ModuleMetadata> module;
+    IfFailRet(getModuleMetadata(moduleId, module));
 
     // skipping non-main methods
-    if (rewriteMainOnly && !currentMethodIsMain(moduleName, moduleNameLength, m_jittedToken)) {
+    bool isMain = currentMethodIsMain(*module->names, method);
+    if (rewriteMainOnly && !isMain) {
+        return S_OK;
+    }
+
+    // entry methods are always rewritten: their probes start and finish the tracking of the threads
+    if (!isMain && isFilteredOut(*module, method)) {
+        vsharp::addFilteredFunctionId(functionId);
         return S_OK;
     }
+    if (!module->metadataEmit) {
+        IfFailRet(completeModuleMetadata(moduleId, module));
+    }
 
     if (rewriteMainOnly) {
-        vsharp::setMainFunctionId(functionId);
+        vsharp::addMainFunctionId(functionId);
     }
 
-    // checking if this method was rewritten before
-    if (instrumentedMethods.find({ m_jittedToken, newModuleId }) != instrumentedMethods.end()) {
-        // LOG(tout << "repeated JIT of " << m_jittedToken << "! skipped" << std::endl);
+    // the method is claimed atomically, so concurrent JITs of one method get one id and only one rewrites it
+    size_t currentMethodId;
+    bool isNew = instrumentedMethods.findOrAdd({ method, moduleId }, [&]() {
+        return coverageTracker->collectMethod({ method, module->names });
+    }, currentMethodId);
+    if (!isNew) {
+        // LOG(tout << "repeated JIT of " << method << "! skipped" << std::endl);
         return S_OK;
     }
 
-    mutex.lock();
-    size_t currentMethodId = coverageTracker->collectMethod({
-            m_jittedToken,
-            assemblyNameLength,
-            assemblyName,
-            moduleNameLength,
-            moduleName}
-        );
-    instrumentedMethods.insert({m_jittedToken, newModuleId});
-    mutex.unlock();
-    ModuleID oldModuleId = m_moduleId;
-    m_moduleId = newModuleId;
-    hr = doInstrumentation(oldModuleId, currentMethodId, moduleName, moduleNameLength);
-
-    return hr;
+    return doInstrumentation(moduleId, *module, method, currentMethodId);
 }
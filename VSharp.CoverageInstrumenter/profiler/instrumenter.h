@@ -2,8 +2,14 @@
 #define INSTRUMENTER_H_
 
 #include "ILRewriter.h"
+#include "ilCache.h"
+#include "cComPtr.h"
+#include "methodFilter.h"
+#include <memory>
 #include <set>
 #include <map>
+#include <string>
+#include <vector>
 
 #ifdef IMAGEHANDLER_EXPORTS
 #define IMAGEHANDLER_API __declspec(dllexport)
@@ -13,36 +19,79 @@
 
 extern "C" IMAGEHANDLER_API void SetEntryMain(char* assemblyName, int assemblyNameLength, char* moduleName, int moduleNameLength, int methodToken);
 extern "C" IMAGEHANDLER_API void GetHistory(UINT_PTR size, UINT_PTR bytes);
+extern "C" IMAGEHANDLER_API void GetHistoryView(UINT_PTR methodsSize, UINT_PTR methodsBytes, UINT_PTR descriptorsCount, UINT_PTR descriptors);
+extern "C" IMAGEHANDLER_API void ReleaseHistoryView();
+extern "C" IMAGEHANDLER_API void MergeCoverageBitmaps(UINT_PTR updatesCount, UINT_PTR updates);
 extern "C" IMAGEHANDLER_API void SetCurrentThreadId(int mapId);
+extern "C" IMAGEHANDLER_API void BeginTest(int testId);
+extern "C" IMAGEHANDLER_API void EndTest(int testId);
 
 namespace vsharp {
 
-extern WCHAR* mainAssemblyName;
-extern int mainAssemblyNameLength;
-extern WCHAR* mainModuleName;
-extern int mainModuleNameLength;
-extern mdMethodDef mainToken;
+// entry methods of a batch run, in which coverage of many tests is collected by one process
+struct EntryMethod {
+    mdMethodDef token;
+    std::u16string moduleName;
+};
+
+// NOTE: the settings are written only by 'Initialize', before any method is JIT-compiled
 extern bool rewriteMainOnly;
+extern bool rewriteWithCounters;
+extern std::vector<EntryMethod> entryMethods;
+
+// The single entry method, set by the environment or by 'SetEntryMain'; it is replaced as a whole,
+// so JIT threads read it without locks, and the replaced ones are released at shutdown
+void setEntryMain(const EntryMethod *main);
+void releaseEntryMains();
+
+// reports of the batch run tests are appended to the file as [testId][size][report] frames
+bool openBatchReports(const char *path);
+bool isBatchRun();
+void closeBatchReports();
+
+struct MethodKeyHash {
+    size_t operator()(const std::pair<mdMethodDef, ModuleID> &method) const {
+        return std::hash<ModuleID>()(method.second) * 31 + method.first;
+    }
+};
+
+// (method token, module) -> method id, for the methods which were rewritten
+extern ShardedMap<std::pair<mdMethodDef, ModuleID>, size_t, MethodKeyHash> instrumentedMethods;
 
-extern std::set<std::pair<FunctionID, ModuleID>> instrumentedMethods;
+// Everything the instrumentation needs from a module, gathered once when the module is loaded;
+// only the names are read for the assemblies excluded by the coverage filters and, if only entry methods
+// are rewritten, for all modules until one of their methods is rewritten
+struct ModuleMetadata {
+    std::shared_ptr<const ModuleNames> names;
+    MethodFilter::AssemblyFilter filter;
+    CComPtr<IMetaDataImport> metadataImport;
+    CComPtr<IMetaDataEmit> metadataEmit;
+    ProbeSignatures signatures;
+    GUID mvid;
+};
 
+// Shared by all JIT threads: the state of one instrumentation lives on the stack of its thread
 class Instrumenter {
 private:
     ICorProfilerInfo8 &m_profilerInfo;  // Does not have ownership
+    ShardedMap<ModuleID, std::shared_ptr<const ModuleMetadata>> m_modules;
 
-    mdMethodDef m_jittedToken;
-    ModuleID m_moduleId;
+    HRESULT readModuleNames(ModuleID moduleId, ModuleMetadata &module);
+    HRESULT readRewriteMetadata(ModuleID moduleId, ModuleMetadata &module);
+    HRESULT readModuleMetadata(ModuleID moduleId, std::shared_ptr<const ModuleMetadata> &module);
+    HRESULT completeModuleMetadata(ModuleID moduleId, std::shared_ptr<const ModuleMetadata> &module);
+    HRESULT getModuleMetadata(ModuleID moduleId, std::shared_ptr<const ModuleMetadata> &module);
+    HRESULT doInstrumentation(ModuleID moduleId, const ModuleMetadata &module, mdMethodDef method, size_t methodId);
 
-    char *m_signatureTokens;
-    unsigned m_signatureTokensLength;
-    std::mutex mutex;
-    HRESULT doInstrumentation(ModuleID oldModuleId, size_t methodId, const WCHAR *moduleName, ULONG moduleNameLength);
-
-    bool currentMethodIsMain(const WCHAR *moduleName, int moduleSize, mdMethodDef method) const;
+    bool currentMethodIsMain(const ModuleNames &names, mdMethodDef method) const;
+    bool isFilteredOut(const ModuleMetadata &module, mdMethodDef method) const;
 
 public:
     explicit Instrumenter(ICorProfilerInfo8 &profilerInfo);
-    ~Instrumenter();
+
+    HRESULT moduleLoaded(ModuleID moduleId);
+    // the id may be reused by another module afterwards
+    void moduleUnloaded(ModuleID moduleId);
 
     HRESULT instrument(FunctionID functionId);
 };
@@ -6,13 +6,45 @@
 
 using namespace vsharp;
 
-static FunctionID mainFunctionId = incorrectFunctionId;
+// several entry methods are tracked when tests of a batch run are executed in one process
+static std::set<FunctionID> mainFunctionIds;
+static std::mutex mainFunctionIdsMutex;
+static ShardedMap<FunctionID, bool> filteredFunctionIds;
 
 std::atomic<int> vsharp::shutdownBlockingRequestsCount {0};
 size_t vsharp::stackBottom;
 ThreadTracker* vsharp::threadTracker;
 ThreadInfo* vsharp::threadInfo;
 
+static std::vector<ThreadStorageBase*> threadStorages;
+static std::mutex threadStoragesMutex;
+
+//region ThreadStorage
+std::vector<void*> &vsharp::threadStorageSlots() {
+    static thread_local std::vector<void*> slots;
+    return slots;
+}
+
+size_t vsharp::registerThreadStorage(ThreadStorageBase *storage) {
+    std::lock_guard<std::mutex> lock(threadStoragesMutex);
+    threadStorages.push_back(storage);
+    return threadStorages.size() - 1;
+}
+
+void vsharp::unregisterThreadStorage(size_t id) {
+    std::lock_guard<std::mutex> lock(threadStoragesMutex);
+    threadStorages[id] = nullptr;
+}
+
+void vsharp::threadStoragesThreadDestroyed(ThreadID thread) {
+    std::lock_guard<std::mutex> lock(threadStoragesMutex);
+    for (auto storage : threadStorages) {
+        if (storage != nullptr)
+            storage->threadDestroyed(thread);
+    }
+}
+//endregion
+
 //region ThreadTracker
 void ThreadTracker::trackCurrentThread() {
     LOG(tout << "<<Thread tracked>>");
@@ -69,6 +101,7 @@ void ThreadTracker::unwindFunctionLeave() {
     auto functionId = unwindFunctionIds.load();
     unwindFunctionIds.remove();
     if (rewriteMainOnly && !vsharp::isMainFunction(functionId)) return;
+    if (vsharp::isFilteredFunction(functionId)) return;
     if ((!isInFilter() || stackBalance() > 1) && !stackBalanceDown()) {
         // stack is empty; function left
         loseCurrentThread();
@@ -122,32 +155,67 @@ bool vsharp::isPossibleStackOverflow() {
 //endregion
 
 //region FunctionId
-void vsharp::setMainFunctionId(FunctionID id) {
+void vsharp::addMainFunctionId(FunctionID id) {
     profiler_assert(id != incorrectFunctionId);
-    mainFunctionId = id;
+    std::lock_guard<std::mutex> lock(mainFunctionIdsMutex);
+    mainFunctionIds.insert(id);
 }
 
 bool vsharp::isMainFunction(FunctionID id) {
-    profiler_assert(mainFunctionId != incorrectFunctionId);
     profiler_assert(id != incorrectFunctionId);
-    return id == mainFunctionId;
+    std::lock_guard<std::mutex> lock(mainFunctionIdsMutex);
+    profiler_assert(!mainFunctionIds.empty());
+    return mainFunctionIds.find(id) != mainFunctionIds.end();
+}
+
+void vsharp::addFilteredFunctionId(FunctionID id) {
+    profiler_assert(id != incorrectFunctionId);
+    bool filtered;
+    filteredFunctionIds.findOrAdd(id, []() { return true; }, filtered);
+}
+
+bool vsharp::isFilteredFunction(FunctionID id) {
+    bool filtered;
+    return filteredFunctionIds.find(id, filtered);
 }
 //endregion
 
 //region ThreadInfo
-ThreadInfo::ThreadInfo(ICorProfilerInfo8* corProfilerInfo_) {
+struct CachedThreadID {
+    ThreadID thread;
+    unsigned generation;
+};
+
+// generation 0 is never used by ThreadInfo, so a fresh thread always misses the cache
+static thread_local CachedThreadID cachedThreadId = {0, 0};
+
+ThreadInfo::ThreadInfo(ICorProfilerInfo8* corProfilerInfo_) : cacheGeneration(1) {
     corProfilerInfo = corProfilerInfo_;
 }
 
 ThreadID ThreadInfo::getCurrentThread() {
+    unsigned generation = cacheGeneration.load(std::memory_order_acquire);
+    if (cachedThreadId.generation == generation)
+        return cachedThreadId.thread;
+
     ThreadID result;
     profiler_assert(corProfilerInfo != nullptr);
     HRESULT hr = corProfilerInfo->GetCurrentThreadID(&result);
     if (hr != S_OK) {
         LOG_ERROR(tout << "getting current thread failed with HRESULT = " << std::hex << hr);
+        return result;
     }
+    cachedThreadId = {result, generation};
     return result;
 }
+
+void ThreadInfo::invalidateCache() {
+    unsigned generation = cacheGeneration.fetch_add(1, std::memory_order_acq_rel) + 1;
+    if (generation == 0) {
+        // skipping the generation reserved for uninitialized caches
+        cacheGeneration.fetch_add(1, std::memory_order_acq_rel);
+    }
+}
 //endregion
 
 void vsharp::dumpUncatchableException(const std::string& exceptionName) {
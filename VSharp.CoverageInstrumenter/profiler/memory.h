@@ -8,6 +8,7 @@
 #include "profiler_assert.h"
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <vector>
 #include <functional>
 #include <shared_mutex>
@@ -38,102 +39,284 @@ template <typename T> void serializePrimitiveArray(const T *obj, size_t len, std
 class ThreadInfo {
 private:
     ICorProfilerInfo8 *corProfilerInfo;
+    // cached ThreadIDs are valid only while their generation matches this one
+    std::atomic<unsigned> cacheGeneration;
 public:
     explicit ThreadInfo(ICorProfilerInfo8 *corProfilerInfo);
     ThreadID getCurrentThread();
+    void invalidateCache();
 };
 extern ThreadInfo* threadInfo;
 
 
-template <typename T> class ThreadStorage {
+// Per-thread cache of ThreadStorage slots, indexed by ThreadStorage id
+std::vector<void*> &threadStorageSlots();
+
+class ThreadStorageBase {
+public:
+    // the slot of a dead thread is reused at once if it is empty, otherwise its value is kept until 'clear'
+    virtual void threadDestroyed(ThreadID thread) = 0;
+    virtual ~ThreadStorageBase() = default;
+};
+
+size_t registerThreadStorage(ThreadStorageBase *storage);
+void unregisterThreadStorage(size_t id);
+void threadStoragesThreadDestroyed(ThreadID thread);
+
+// Each managed thread owns one slot per storage and accesses it without locks via the thread-local cache;
+// the lock is taken only when a thread looks up its slot and when a snapshot of all slots is requested.
+// A cached slot is used only while it is owned by the current ThreadID, so a managed thread moved to another
+// OS thread, or a dead thread's slot given to another thread, is looked up again. Slots are recycled, never freed
+// before the storage, so a stale cached pointer is always safe to check
+template <typename T> class ThreadStorage : public ThreadStorageBase {
 private:
-    std::map<ThreadID, T> innerStorage;
-    std::mutex innerStorageLock;
+    static_assert(std::is_trivially_copyable<T>::value, "Values of ThreadStorage are stored atomically");
+
+    struct Slot {
+        ThreadID thread;                // reported by the snapshots, written under the lock
+        std::atomic<ThreadID> owner;    // 0 if the slot is retired or free
+        // written by the owner, read by the snapshots of other threads
+        std::atomic<bool> present;
+        std::atomic<T> value;
+    };
+
+    const size_t id;
+    std::unordered_map<ThreadID, Slot*> slots;
+    // slots of dead threads, which still have values to report
+    std::vector<Slot*> retiredSlots;
+    std::vector<Slot*> freeSlots;
+    std::mutex slotsLock;
+
+    Slot *cachedSlot(ThreadID thread) const {
+        auto &cache = threadStorageSlots();
+        if (id >= cache.size())
+            return nullptr;
+        auto slot = static_cast<Slot*>(cache[id]);
+        return slot != nullptr && slot->owner.load(std::memory_order_acquire) == thread ? slot : nullptr;
+    }
+
+    void cacheSlot(Slot *slot) const {
+        auto &cache = threadStorageSlots();
+        if (cache.size() <= id)
+            cache.resize(id + 1, nullptr);
+        cache[id] = slot;
+    }
+
+    Slot *currentSlot() {
+        ThreadID thread = threadInfo->getCurrentThread();
+        Slot *slot = cachedSlot(thread);
+        if (slot != nullptr)
+            return slot;
 
-    bool exist_(ThreadID thread) {
-        auto e = innerStorage.find(thread);
-        return e != innerStorage.end();
+        slotsLock.lock();
+        auto it = slots.find(thread);
+        if (it != slots.end()) {
+            slot = it->second;
+        } else {
+            if (freeSlots.empty()) {
+                slot = new Slot();
+            } else {
+                slot = freeSlots.back();
+                freeSlots.pop_back();
+            }
+            slot->thread = thread;
+            slot->present.store(false, std::memory_order_relaxed);
+            slot->owner.store(thread, std::memory_order_release);
+            slots.emplace(thread, slot);
+        }
+        slotsLock.unlock();
+
+        cacheSlot(slot);
+        return slot;
+    }
+
+    template <typename F> void forEachSlot(F f) {
+        for (auto &entry : slots)
+            f(entry.second);
+        for (auto slot : retiredSlots)
+            f(slot);
     }
 
 public:
-    explicit ThreadStorage() {
-        innerStorage = std::map<ThreadID, T>();
+    explicit ThreadStorage() : id(registerThreadStorage(this)) {}
+
+    ~ThreadStorage() override {
+        unregisterThreadStorage(id);
+        forEachSlot([](Slot *slot) { delete slot; });
+        for (auto slot : freeSlots)
+            delete slot;
     }
 
     void store(T data) {
-        ThreadID thread = threadInfo->getCurrentThread();
-        innerStorageLock.lock();
-        profiler_assert(!exist_(thread));
-        innerStorage[thread] = data;
-        innerStorageLock.unlock();
+        Slot *slot = currentSlot();
+        profiler_assert(!slot->present.load(std::memory_order_relaxed));
+        slot->value.store(data, std::memory_order_relaxed);
+        slot->present.store(true, std::memory_order_release);
     }
 
     void storeOrUpdate(T data) {
-        ThreadID thread = threadInfo->getCurrentThread();
-        innerStorageLock.lock();
-        innerStorage[thread] = data;
-        innerStorageLock.unlock();
+        Slot *slot = currentSlot();
+        slot->value.store(data, std::memory_order_relaxed);
+        slot->present.store(true, std::memory_order_release);
     }
 
     T load() {
-        ThreadID thread = threadInfo->getCurrentThread();
-        innerStorageLock.lock();
-        profiler_assert(exist_(thread));
-        T result = innerStorage[thread];
-        innerStorageLock.unlock();
-        return result;
+        Slot *slot = currentSlot();
+        profiler_assert(slot->present.load(std::memory_order_relaxed));
+        return slot->value.load(std::memory_order_relaxed);
     }
 
     T update(T (*f)(T)) {
-        ThreadID thread = threadInfo->getCurrentThread();
-        innerStorageLock.lock();
-        profiler_assert(exist_(thread));
-        auto result = f(innerStorage[thread]);
-        innerStorage[thread] = result;
-        innerStorageLock.unlock();
+        Slot *slot = currentSlot();
+        profiler_assert(slot->present.load(std::memory_order_relaxed));
+        T result = f(slot->value.load(std::memory_order_relaxed));
+        slot->value.store(result, std::memory_order_relaxed);
         return result;
     }
 
     size_t size() {
-        innerStorageLock.lock();
-        auto result = innerStorage.size();
-        innerStorageLock.unlock();
+        size_t result = 0;
+        slotsLock.lock();
+        forEachSlot([&result](Slot *slot) {
+            if (slot->present.load(std::memory_order_acquire))
+                result++;
+        });
+        slotsLock.unlock();
         return result;
     }
 
     bool exist() {
-        ThreadID thread = threadInfo->getCurrentThread();
-        innerStorageLock.lock();
-        auto e = innerStorage.find(thread);
-        auto result = e != innerStorage.end();
-        innerStorageLock.unlock();
-        return result;
+        // the slot is created even if it is absent, so probes of untracked threads do not take the lock again
+        return currentSlot()->present.load(std::memory_order_acquire);
     }
 
     void remove() {
-        ThreadID thread = threadInfo->getCurrentThread();
-        innerStorageLock.lock();
-        profiler_assert(exist_(thread));
-        innerStorage.erase(thread);
-        innerStorageLock.unlock();
+        Slot *slot = currentSlot();
+        profiler_assert(slot->present.load(std::memory_order_relaxed));
+        slot->present.store(false, std::memory_order_release);
     }
 
     void clear() {
-        innerStorageLock.lock();
-        innerStorage.clear();
-        innerStorageLock.unlock();
+        slotsLock.lock();
+        for (auto &entry : slots)
+            entry.second->present.store(false, std::memory_order_release);
+        for (auto slot : retiredSlots) {
+            slot->present.store(false, std::memory_order_relaxed);
+            freeSlots.push_back(slot);
+        }
+        retiredSlots.clear();
+        slotsLock.unlock();
     }
 
     std::vector<std::pair<ThreadID, T>> items() {
         auto result = std::vector<std::pair<ThreadID, T>>();
-        innerStorageLock.lock();
-        for (auto e: innerStorage) {
-            result.emplace_back(e.first, e.second);
-        }
-        innerStorageLock.unlock();
+        slotsLock.lock();
+        forEachSlot([&result](Slot *slot) {
+            if (slot->present.load(std::memory_order_acquire))
+                result.emplace_back(slot->thread, slot->value.load(std::memory_order_relaxed));
+        });
+        slotsLock.unlock();
         return result;
     }
 
+    void threadDestroyed(ThreadID thread) override {
+        slotsLock.lock();
+        auto it = slots.find(thread);
+        if (it != slots.end()) {
+            Slot *slot = it->second;
+            // the id may be reused by a new thread, which must not pick the slot up from a stale cache
+            slot->owner.store(0, std::memory_order_release);
+            if (slot->present.load(std::memory_order_acquire))
+                retiredSlots.push_back(slot);
+            else
+                freeSlots.push_back(slot);
+            slots.erase(it);
+        }
+        slotsLock.unlock();
+    }
+};
+
+// Hash map split into independently locked shards, so concurrent accesses to different keys rarely contend
+template <typename Key, typename Value, typename Hash = std::hash<Key>> class ShardedMap {
+private:
+    static const size_t shardsCount = 64;
+
+    // NOTE: C++11 'new' ignores extended alignment, so the shards are padded instead of aligned:
+    // a whole cache line separates the fields of neighbouring shards wherever the map is placed
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<Key, Value, Hash> items;
+        char padding[64];
+    };
+
+    Shard shards[shardsCount];
+
+    Shard &shardOf(const Key &key) {
+        // hashes of pointers and tokens are the values themselves, so they are mixed before picking the shard
+        UINT64 hash = static_cast<UINT64>(Hash()(key)) * 0x9E3779B97F4A7C15ull;
+        return shards[hash >> 58];
+    }
+
+public:
+    bool find(const Key &key, Value &value) {
+        Shard &shard = shardOf(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto it = shard.items.find(key);
+        if (it == shard.items.end())
+            return false;
+        value = it->second;
+        return true;
+    }
+
+    // 'create' is called under the lock of the shard, so exactly one caller adds the value of the key;
+    // returns 'true' if it was this call
+    template <typename F> bool findOrAdd(const Key &key, F create, Value &value) {
+        Shard &shard = shardOf(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto it = shard.items.find(key);
+        if (it != shard.items.end()) {
+            value = it->second;
+            return false;
+        }
+        value = create();
+        shard.items.emplace(key, value);
+        return true;
+    }
+
+    // replaces the value of the key only if it is still 'expected', otherwise 'value' gets the current one;
+    // returns 'true' if the value was replaced or the key is absent
+    bool replace(const Key &key, const Value &expected, Value &value) {
+        Shard &shard = shardOf(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto it = shard.items.find(key);
+        if (it == shard.items.end())
+            return true;
+        if (!(it->second == expected)) {
+            value = it->second;
+            return false;
+        }
+        it->second = value;
+        return true;
+    }
+
+    void erase(const Key &key) {
+        Shard &shard = shardOf(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        shard.items.erase(key);
+    }
+
+    // visits every shard, so it is meant for rare events like unloads
+    template <typename P> void eraseIf(P predicate) {
+        for (auto &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.lock);
+            for (auto it = shard.items.begin(); it != shard.items.end();) {
+                if (predicate(it->first, it->second))
+                    it = shard.items.erase(it);
+                else
+                    ++it;
+            }
+        }
+    }
 };
 
 class ThreadTracker {
@@ -173,8 +356,11 @@ extern std::atomic<int> shutdownBlockingRequestsCount;
 
 void dumpUncatchableException(const std::string& exceptionName);
 bool isPossibleStackOverflow();
-void setMainFunctionId(FunctionID id);
+void addMainFunctionId(FunctionID id);
 bool isMainFunction(FunctionID id);
+// functions skipped by the coverage filters have no enter/leave probes, so their unwinds are not balanced
+void addFilteredFunctionId(FunctionID id);
+bool isFilteredFunction(FunctionID id);
 }
 
 #endif // MEMORY_H_
\ No newline at end of file
@@ -0,0 +1,194 @@
+#include "methodFilter.h"
+#include "logging.h"
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+using namespace vsharp;
+
+MethodFilter* vsharp::methodFilter = nullptr;
+
+static bool isAnything(const std::string &pattern) {
+    return pattern.find_first_not_of('*') == std::string::npos;
+}
+
+// Greedy matching with backtracking to the last '*', linear for patterns with a single '*'
+static bool matchesGlob(const std::string &pattern, const std::string &text) {
+    size_t p = 0, t = 0;
+    size_t starPattern = std::string::npos, starText = 0;
+    while (t < text.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t])) {
+            p++;
+            t++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            starPattern = p++;
+            starText = t;
+        } else if (starPattern != std::string::npos) {
+            p = starPattern + 1;
+            t = ++starText;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+        p++;
+    return p == pattern.size();
+}
+
+static std::string trim(const std::string &str) {
+    auto first = str.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos)
+        return "";
+    auto last = str.find_last_not_of(" \t\r\n");
+    return str.substr(first, last - first + 1);
+}
+
+bool MethodFilter::addRule(const std::string &text) {
+    std::string rule = trim(text);
+    if (rule.size() < 2 || (rule[0] != '+' && rule[0] != '-'))
+        return false;
+
+    Rule parsed;
+    parsed.include = rule[0] == '+';
+    size_t position = 1;
+    if (rule[position] == '[') {
+        auto close = rule.find(']', position);
+        if (close == std::string::npos)
+            return false;
+        parsed.assembly = rule.substr(position + 1, close - position - 1);
+        position = close + 1;
+    }
+    auto separator = rule.find("::", position);
+    parsed.type = rule.substr(position, separator == std::string::npos ? std::string::npos : separator - position);
+    if (separator != std::string::npos)
+        parsed.method = rule.substr(separator + 2);
+
+    for (auto part : {&parsed.assembly, &parsed.type, &parsed.method}) {
+        if (part->empty())
+            *part = "*";
+    }
+    parsed.anyMethod = isAnything(parsed.type) && isAnything(parsed.method);
+    hasIncludes = hasIncludes || parsed.include;
+    rules.push_back(parsed);
+    return true;
+}
+
+size_t MethodFilter::rulesCount() const {
+    return rules.size();
+}
+
+MethodFilter::AssemblyFilter MethodFilter::forAssembly(const std::string &assembly) const {
+    AssemblyFilter filter;
+    filter.requiresInclude = hasIncludes;
+    bool includesAll = false;
+    bool excludesSome = false;
+    for (auto &rule : rules) {
+        if (!isAnything(rule.assembly) && !matchesGlob(rule.assembly, assembly))
+            continue;
+        if (!rule.include && rule.anyMethod) {
+            filter.decision = Excluded;
+            filter.rules.clear();
+            return filter;
+        }
+        includesAll = includesAll || (rule.include && rule.anyMethod);
+        excludesSome = excludesSome || !rule.include;
+        filter.rules.push_back(&rule);
+    }
+
+    bool includesSome = false;
+    for (auto rule : filter.rules)
+        includesSome = includesSome || rule->include;
+    if (hasIncludes && !includesSome) {
+        filter.decision = Excluded;
+        filter.rules.clear();
+        return filter;
+    }
+    bool included = !hasIncludes || includesAll;
+    filter.decision = included && !excludesSome ? Included : DependsOnMethod;
+    return filter;
+}
+
+MethodFilter::Decision MethodFilter::AssemblyFilter::assemblyDecision() const {
+    return decision;
+}
+
+bool MethodFilter::AssemblyFilter::matches(const std::string &type, const std::string &method) const {
+    if (decision != DependsOnMethod)
+        return decision == Included;
+    bool included = !requiresInclude;
+    for (auto rule : rules) {
+        if (rule->include && included)
+            continue;
+        if (!matchesGlob(rule->type, type) || !matchesGlob(rule->method, method))
+            continue;
+        if (!rule->include)
+            return false;
+        included = true;
+    }
+    return included;
+}
+
+static void addRules(MethodFilter &filter, std::istream &rules, char separator) {
+    std::string rule;
+    while (std::getline(rules, rule, separator)) {
+        auto comment = rule.find('#');
+        if (comment != std::string::npos)
+            rule.erase(comment);
+        if (trim(rule).empty())
+            continue;
+        if (!filter.addRule(rule))
+            LOG_ERROR(tout << "Malformed coverage filter rule is ignored: " << rule);
+    }
+}
+
+MethodFilter *vsharp::loadMethodFilter() {
+    auto filter = new MethodFilter();
+    const char *rules = std::getenv("COVERAGE_FILTERS");
+    if (rules != nullptr) {
+        std::istringstream in(rules);
+        addRules(*filter, in, ';');
+    }
+    const char *rulesPath = std::getenv("COVERAGE_FILTERS_FILE");
+    if (rulesPath != nullptr) {
+        std::ifstream in(rulesPath);
+        if (!in.is_open())
+            LOG_ERROR(tout << "Coverage filters file can not be opened: " << rulesPath);
+        addRules(*filter, in, '\n');
+    }
+    if (filter->rulesCount() == 0) {
+        delete filter;
+        return nullptr;
+    }
+    return filter;
+}
+
+std::string vsharp::toUtf8(const WCHAR *str, size_t length) {
+    std::string result;
+    result.reserve(length);
+    for (size_t i = 0; i < length && str[i] != 0; i++) {
+        UINT32 code = static_cast<char16_t>(str[i]);
+        if (code >= 0xD800 && code < 0xDC00 && i + 1 < length) {
+            UINT32 low = static_cast<char16_t>(str[i + 1]);
+            if (low >= 0xDC00 && low < 0xE000) {
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+        if (code < 0x80) {
+            result.push_back(static_cast<char>(code));
+        } else if (code < 0x800) {
+            result.push_back(static_cast<char>(0xC0 | (code >> 6)));
+            result.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        } else if (code < 0x10000) {
+            result.push_back(static_cast<char>(0xE0 | (code >> 12)));
+            result.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+            result.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        } else {
+            result.push_back(static_cast<char>(0xF0 | (code >> 18)));
+            result.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+            result.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+            result.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+        }
+    }
+    return result;
+}
@@ -0,0 +1,66 @@
+#ifndef METHODFILTER_H_
+#define METHODFILTER_H_
+
+#include "cor.h"
+#include <string>
+#include <vector>
+
+namespace vsharp {
+
+// Rules of the form '+[assembly]type::method' include the matching methods, '-[assembly]type::method' exclude them.
+// Every part is a glob with '*' and '?', 'type' is the full name with the namespace ('Outer+Nested' for nested types),
+// omitted parts match anything. A method is instrumented if it matches some include rule (or there are none)
+// and no exclude rule
+class MethodFilter {
+public:
+    enum Decision {
+        Excluded,
+        Included,
+        DependsOnMethod
+    };
+
+    struct Rule {
+        bool include;
+        std::string assembly;
+        std::string type;
+        std::string method;
+        bool anyMethod;     // both 'type' and 'method' match anything
+    };
+
+    // The rules which apply to the methods of one assembly
+    class AssemblyFilter {
+    private:
+        std::vector<const Rule*> rules;
+        bool requiresInclude = false;
+        Decision decision = Included;
+
+        friend class MethodFilter;
+    public:
+        // if it is not 'DependsOnMethod', the decision is the same for all methods of the assembly
+        Decision assemblyDecision() const;
+        bool matches(const std::string &type, const std::string &method) const;
+    };
+
+private:
+    std::vector<Rule> rules;
+    bool hasIncludes = false;
+
+public:
+    // returns 'false' if the rule is malformed
+    bool addRule(const std::string &rule);
+    size_t rulesCount() const;
+    AssemblyFilter forAssembly(const std::string &assembly) const;
+};
+
+// Reads the rules from COVERAGE_FILTERS (separated by ';') and from the file COVERAGE_FILTERS_FILE
+// (one per line, '#' starts a comment); nullptr if there are no rules
+MethodFilter *loadMethodFilter();
+
+// nullptr if every method is instrumented
+extern MethodFilter *methodFilter;
+
+std::string toUtf8(const WCHAR *str, size_t length);
+
+}
+
+#endif // METHODFILTER_H_
@@ -8,5 +8,7 @@ class OS final {
 public:
     static std::string unicodeToAnsi(const WCHAR* str);
     static void sleepSeconds(int seconds);
+    // path of the loaded profiler library; empty if it can not be found
+    static std::string profilerImagePath();
 };
 #endif //_OS_H
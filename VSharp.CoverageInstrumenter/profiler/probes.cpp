@@ -4,27 +4,20 @@
 
 using namespace vsharp;
 
-ProbeCall::ProbeCall(INT_PTR methodAddr) {
-    addr = methodAddr;
+static thread_local const ProbeSignatures *currentProbeSignatures = nullptr;
+
+void vsharp::setCurrentProbeSignatures(const ProbeSignatures *signatures) {
+    currentProbeSignatures = signatures;
 }
 
-mdSignature ProbeCall::getSig() {
-    ThreadID thread = threadInfo->getCurrentThread();
-    threadMappingLock.lock();
-    auto pos = threadMapping.find(thread);
-    if (pos == threadMapping.end()) {
-        threadMappingLock.unlock();
-        return 0;
-    }
-    threadMappingLock.unlock();
-    return pos->second;
+ProbeCall::ProbeCall(INT_PTR methodAddr, ProbeSignatureKind kind) {
+    addr = methodAddr;
+    signatureKind = kind;
 }
 
-void ProbeCall::setSig(mdSignature sig) {
-    ThreadID thread = threadInfo->getCurrentThread();
-    threadMappingLock.lock();
-    threadMapping[thread] = sig;
-    threadMappingLock.unlock();
+mdSignature ProbeCall::getSig() const {
+    profiler_assert(currentProbeSignatures != nullptr);
+    return currentProbeSignatures->tokens[signatureKind];
 }
 
 CoverageProbes* vsharp::getProbes() {
@@ -33,17 +26,17 @@ CoverageProbes* vsharp::getProbes() {
 
 void vsharp::InitializeProbes() {
     auto covProbes = vsharp::getProbes();
-    covProbes->Coverage = new ProbeCall((INT_PTR) &Track_Coverage);
-    covProbes->Branch = new ProbeCall((INT_PTR) &Branch);
-    covProbes->Enter = new ProbeCall((INT_PTR) &Track_Enter);
-    covProbes->EnterMain = new ProbeCall((INT_PTR) &Track_EnterMain);
-    covProbes->Leave = new ProbeCall((INT_PTR) &Track_Leave);
-    covProbes->LeaveMain = new ProbeCall((INT_PTR) &Track_LeaveMain);
-    covProbes->Finalize_Call = new ProbeCall((INT_PTR) &Finalize_Call);
-    covProbes->Call = new ProbeCall((INT_PTR) &Track_Call);
-    covProbes->Tailcall = new ProbeCall((INT_PTR) &Track_Tailcall);
-    covProbes->Stsfld = new ProbeCall((INT_PTR) &Track_Stsfld);
-    covProbes->Throw = new ProbeCall((INT_PTR) &Track_Throw);
+    covProbes->Coverage = new ProbeCall((INT_PTR) &Track_Coverage, OffsetIdSignature);
+    covProbes->Branch = new ProbeCall((INT_PTR) &Branch, OffsetIdSignature);
+    covProbes->Enter = new ProbeCall((INT_PTR) &Track_Enter, OffsetIdIdSignature);
+    covProbes->EnterMain = new ProbeCall((INT_PTR) &Track_EnterMain, OffsetIdIdSignature);
+    covProbes->Leave = new ProbeCall((INT_PTR) &Track_Leave, OffsetIdSignature);
+    covProbes->LeaveMain = new ProbeCall((INT_PTR) &Track_LeaveMain, OffsetIdSignature);
+    covProbes->Finalize_Call = new ProbeCall((INT_PTR) &Finalize_Call, OffsetSignature);
+    covProbes->Call = new ProbeCall((INT_PTR) &Track_Call, OffsetIdSignature);
+    covProbes->Tailcall = new ProbeCall((INT_PTR) &Track_Tailcall, OffsetIdSignature);
+    covProbes->Stsfld = new ProbeCall((INT_PTR) &Track_Stsfld, OffsetIdSignature);
+    covProbes->Throw = new ProbeCall((INT_PTR) &Track_Throw, OffsetIdSignature);
     LOG(tout << "probes initialized" << std::endl);
 }
 
@@ -53,30 +46,58 @@ CoverageTracker* vsharp::coverageTracker;
 //region MethodInfo
 void MethodInfo::serialize(std::vector<char>& buffer) const {
     serializePrimitive(token, buffer);
-    serializePrimitive(assemblyNameLength, buffer);
-    serializePrimitiveArray(assemblyName, assemblyNameLength, buffer);
-    serializePrimitive(moduleNameLength, buffer);
-    serializePrimitiveArray(moduleName, moduleNameLength, buffer);
+    serializePrimitive((ULONG) names->assemblyName.size(), buffer);
+    serializePrimitiveArray(names->assemblyName.data(), names->assemblyName.size(), buffer);
+    serializePrimitive((ULONG) names->moduleName.size(), buffer);
+    serializePrimitiveArray(names->moduleName.data(), names->moduleName.size(), buffer);
 }
 //endregion
 
-//region CoverageRecord
-void CoverageRecord::serialize(std::vector<char>& buffer) const {
-    serializePrimitive(offset, buffer);
-    serializePrimitive(event, buffer);
-    serializePrimitive(methodId, buffer);
-    serializePrimitive(thread, buffer);
+//region CoverageChunkPool
+static CoverageChunkPool chunkPool;
+
+CoverageChunk* CoverageChunkPool::acquire() {
+    CoverageChunk* chunk = nullptr;
+    freeChunksMutex.lock();
+    if (!freeChunks.empty()) {
+        chunk = freeChunks.back();
+        freeChunks.pop_back();
+    }
+    freeChunksMutex.unlock();
+    if (chunk == nullptr)
+        chunk = new CoverageChunk();
+    chunk->count = 0;
+    return chunk;
+}
+
+void CoverageChunkPool::release(CoverageChunk* chunk) {
+    freeChunksMutex.lock();
+    freeChunks.push_back(chunk);
+    freeChunksMutex.unlock();
+}
+
+CoverageChunkPool::~CoverageChunkPool() {
+    for (auto chunk : freeChunks)
+        delete chunk;
 }
 //endregion
 
 //region CoverageHistory
-CoverageHistory::CoverageHistory(OFFSET offset, int methodId) {
-    auto insertResult = visitedMethods.insert(methodId);
-    LOG(if (insertResult.second) {
-       tout << "Visit method: " << methodId;
-    });
-    auto record = new CoverageRecord({offset, EnterMain, threadInfo->getCurrentThread(), methodId});
-    records.push_back(record);
+CoverageHistory::CoverageHistory(OFFSET offset, int methodId, bool collectBitmap)
+    : thread(threadInfo->getCurrentThread())
+    , recordsCount(0)
+    , currentChunk(nullptr)
+    , bitmap(collectBitmap ? new CoverageBitmap() : nullptr)
+{
+    addCoverage(offset, EnterMain, methodId);
+}
+
+CoverageHistory::CoverageHistory(bool collectBitmap)
+    : thread(threadInfo->getCurrentThread())
+    , recordsCount(0)
+    , currentChunk(nullptr)
+    , bitmap(collectBitmap ? new CoverageBitmap() : nullptr)
+{
 }
 
 void CoverageHistory::addCoverage(OFFSET offset, CoverageEvent event, int methodId) {
@@ -86,53 +107,166 @@ void CoverageHistory::addCoverage(OFFSET offset, CoverageEvent event, int method
             tout << "Visit method: " << methodId;
         }
     );
-    auto record = new CoverageRecord({offset, event, threadInfo->getCurrentThread(), methodId});
-    records.push_back(record);
+    if (bitmap != nullptr) {
+        // only control flow points form edges, other events just mark the method as visited
+        if (event == EnterMain || event == BranchHit || event == TrackCoverage)
+            bitmap->addEdge(offset, methodId);
+        return;
+    }
+    if (currentChunk == nullptr || currentChunk->count == CoverageChunk::capacity) {
+        currentChunk = chunkPool.acquire();
+        chunks.push_back(currentChunk);
+    }
+    currentChunk->records[currentChunk->count++] = {offset, event, methodId, thread};
+    recordsCount++;
 }
 
 void CoverageHistory::serialize(std::vector<char>& buffer) const {
-    serializePrimitive(static_cast<int> (records.size()), buffer);
-    LOG(tout << "Serialize reports count: " << static_cast<int> (records.size()));
-    for (auto r: records) {
-        r->serialize(buffer);
+    if (bitmap != nullptr) {
+        serializePrimitive(static_cast<int> (CoverageBitmap::size), buffer);
+        auto size = buffer.size();
+        buffer.resize(size + CoverageBitmap::size);
+        std::memcpy(buffer.data() + size, bitmap->hits, CoverageBitmap::size);
+        return;
+    }
+    serializePrimitive(static_cast<int> (recordsCount), buffer);
+    LOG(tout << "Serialize reports count: " << static_cast<int> (recordsCount));
+    auto size = buffer.size();
+    buffer.resize(size + recordsCount * sizeof(CoverageRecord));
+    for (auto chunk : chunks) {
+        auto chunkSize = chunk->count * sizeof(CoverageRecord);
+        std::memcpy(buffer.data() + size, chunk->records, chunkSize);
+        size += chunkSize;
+    }
+}
+
+void CoverageHistory::describe(INT32 threadId, INT32 historyIndex, std::vector<CoverageChunkDescriptor>& descriptors) const {
+    // bitmap histories have no records, but the thread still has to be reported
+    if (chunks.empty())
+        descriptors.push_back({nullptr, 0, threadId, historyIndex, 0});
+    for (auto chunk : chunks) {
+        descriptors.push_back({chunk->records, static_cast<INT32>(chunk->count), threadId, historyIndex, 0});
     }
 }
 
+const CoverageBitmap* CoverageHistory::getBitmap() const {
+    return bitmap;
+}
+
 CoverageHistory::~CoverageHistory() {
-    records.clear();
+    for (auto chunk : chunks)
+        chunkPool.release(chunk);
+    chunks.clear();
+    delete bitmap;
+}
+//endregion
+
+//region CounterSlab
+CounterSlab::CounterSlab(int methodId, size_t capacity)
+    : countersCount(0)
+    , capacity(capacity)
+    , counters(new BYTE[capacity]())
+    , methodId(methodId)
+{
+    points.reserve(capacity);
+}
+
+BYTE* CounterSlab::addPoint(OFFSET offset, CoverageEvent event) {
+    profiler_assert(countersCount < capacity);
+    points.push_back({offset, event, countersCount});
+    return &counters[countersCount++];
+}
+
+// returns nullptr if the region is already counted
+BYTE* CounterSlab::addPoint(OFFSET offset, CoverageEvent event, unsigned region) {
+    auto known = regionCounters.find(region);
+    if (known != regionCounters.end()) {
+        points.push_back({offset, event, known->second});
+        return nullptr;
+    }
+    regionCounters[region] = countersCount;
+    return addPoint(offset, event);
+}
+
+// the slab is taken from the cache of rewritten methods, so counters are already assigned
+void CounterSlab::restorePoint(OFFSET offset, CoverageEvent event, size_t counter) {
+    profiler_assert(counter < capacity);
+    points.push_back({offset, event, counter});
+    countersCount = std::max(countersCount, counter + 1);
+}
+
+const std::vector<CounterSlab::Point>& CounterSlab::getPoints() const {
+    return points;
+}
+
+BYTE* CounterSlab::counterAt(size_t index) const {
+    profiler_assert(index < capacity);
+    return &counters[index];
+}
+
+size_t CounterSlab::counterIndex(const BYTE* counter) const {
+    return counter - counters;
+}
+
+size_t CounterSlab::countersUsed() const {
+    return countersCount;
+}
+
+size_t CounterSlab::pointsCount() const {
+    return points.size();
+}
+
+void CounterSlab::addHits(CoverageHistory*& history) const {
+    for (size_t i = 0; i < points.size(); i++) {
+        if (counters[points[i].counter] == 0) continue;
+        if (history == nullptr)
+            history = new CoverageHistory(false);
+        history->addCoverage(points[i].offset, points[i].event, methodId);
+    }
+}
+
+void CounterSlab::resetHits() {
+    std::memset(counters, 0, countersCount);
+}
+
+CounterSlab::~CounterSlab() {
+    delete[] counters;
 }
 //endregion
 
 //region CoverageTracker
-CoverageTracker::CoverageTracker(bool collectMainOnly_) {
+CoverageTracker::CoverageTracker(bool collectMainOnly_, bool collectBitmap_) {
     collectMainOnly = collectMainOnly_;
+    collectBitmap = collectBitmap_;
 }
 
 void CoverageTracker::addCoverage(UINT32 offset, CoverageEvent event, int methodId) {
     profiler_assert(threadTracker->isCurrentThreadTracked());
     bool mainOnly = coverageTracker->isCollectMainOnly();
     if ((event == EnterMain && mainOnly || !mainOnly) && !trackedCoverage.exist()) {
-        trackedCoverage.store(new CoverageHistory(offset, methodId));
+        trackedCoverage.store(new CoverageHistory(offset, methodId, collectBitmap));
     } else {
         trackedCoverage.load()->addCoverage(offset, event, methodId);
     }
 }
 
-char* CoverageTracker::serializeCoverageReport(size_t* size) {
-    auto coverage = trackedCoverage.items();
-    auto threadMapping = threadTracker->getMapping();
-    int coverageCount = static_cast<int>(coverage.size());
+static int mappedThreadId(const std::vector<std::pair<ThreadID, int>>& threadMapping, ThreadID thread) {
+    for (auto &j : threadMapping) {
+        if (j.first == thread)
+            return j.second;
+    }
+    return 0;
+}
 
-    trackedCoverage.clear();
+void CoverageTracker::serializeVisitedMethods(const std::vector<std::pair<ThreadID, CoverageHistory*>>& coverage, std::vector<char>& buffer) {
     collectedMethodsMutex.lock();
 
-    auto buffer = std::vector<char>();
     auto methodsToSerialize = std::vector<std::pair<int, MethodInfo>>();
     auto visitedMethodsByAllThreads = std::set<int>();
 
-    for (int i = 0; i < coverageCount; i++) {
-        if (coverage[i].second != nullptr) {
-            auto visitedByI = coverage[i].second->visitedMethods;
+    for (auto &history : coverage) {
+        if (history.second != nullptr) {
+            auto &visitedByI = history.second->visitedMethods;
             visitedMethodsByAllThreads.insert(visitedByI.begin(), visitedByI.end());
         }
     }
@@ -155,20 +289,25 @@ char* CoverageTracker::serializeCoverageReport(size_t* size) {
         el.second.serialize(buffer);
     }
 
+    collectedMethodsMutex.unlock();
+}
+
+char* CoverageTracker::serializeCoverageReport(size_t* size) {
+    auto coverage = trackedCoverage.items();
+    auto threadMapping = threadTracker->getMapping();
+    int coverageCount = static_cast<int>(coverage.size());
+
+    trackedCoverage.clear();
+
+    auto buffer = std::vector<char>();
+    serializeVisitedMethods(coverage, buffer);
+
     serializePrimitive(static_cast<int> (coverageCount), buffer);
     LOG(tout << "Serialize coverage count: " << coverageCount);
     for (int i = 0; i < coverageCount; i++) {
-        if (threadMapping.size() == 0) {
-            serializePrimitive(0, buffer);
-        } else {
-            for (auto &j : threadMapping) {
-                if (j.first == coverage[i].first) {
-                    LOG(tout << "Serialize thread id: " << j.second);
-                    serializePrimitive(j.second, buffer);
-                    break;
-                }
-            }
-        }
+        auto threadId = mappedThreadId(threadMapping, coverage[i].first);
+        LOG(tout << "Serialize thread id: " << threadId);
+        serializePrimitive(threadId, buffer);
         if (coverage[i].second != nullptr) {
             LOG(tout << "Serialize coverage: " << coverage[i].first);
             serializePrimitive(0, buffer);
@@ -179,9 +318,9 @@ char* CoverageTracker::serializeCoverageReport(size_t* size) {
         }
     }
 
-    methodsToSerialize.clear();
-    visitedMethodsByAllThreads.clear();
-    collectedMethodsMutex.unlock();
+    // returning the chunks of serialized histories to the pool
+    for (auto &history : coverage)
+        delete history.second;
 
     *size = buffer.size();
     char* array = new char[*size];
@@ -189,6 +328,90 @@ char* CoverageTracker::serializeCoverageReport(size_t* size) {
     return array;
 }
 
+void CoverageTracker::publishCoverageView(char** methods, size_t* methodsSize, CoverageChunkDescriptor** descriptors, size_t* descriptorsCount) {
+    releaseCoverageView();
+
+    auto coverage = trackedCoverage.items();
+    auto threadMapping = threadTracker->getMapping();
+    trackedCoverage.clear();
+
+    serializeVisitedMethods(coverage, viewMethods);
+
+    for (int i = 0; i < coverage.size(); i++) {
+        auto threadId = mappedThreadId(threadMapping, coverage[i].first);
+        auto history = coverage[i].second;
+        if (history != nullptr) {
+            history->describe(threadId, i, viewDescriptors);
+            viewHistories.push_back(history);
+        } else {
+            LOG(tout << "Publish coverage (aborted): " << coverage[i].first);
+            viewDescriptors.push_back({nullptr, 0, threadId, i, 1});
+        }
+    }
+    LOG(tout << "Published coverage view: " << coverage.size() << " threads, " << viewDescriptors.size() << " chunks");
+
+    *methods = viewMethods.data();
+    *methodsSize = viewMethods.size();
+    *descriptors = viewDescriptors.data();
+    *descriptorsCount = viewDescriptors.size();
+}
+
+void CoverageTracker::releaseCoverageView() {
+    for (auto history : viewHistories)
+        delete history;
+    viewHistories.clear();
+    viewDescriptors.clear();
+    viewMethods.clear();
+}
+
+void CoverageTracker::mergeBitmaps(BitmapUpdate** updates, size_t* updatesCount) {
+    auto coverage = trackedCoverage.items();
+    auto threadMapping = threadTracker->getMapping();
+    trackedCoverage.clear();
+
+    bitmapUpdates.clear();
+    for (auto &history : coverage) {
+        if (history.second == nullptr) continue;
+        auto bitmap = history.second->getBitmap();
+        if (bitmap != nullptr)
+            virginBitmap.merge(*bitmap, mappedThreadId(threadMapping, history.first), bitmapUpdates);
+        delete history.second;
+    }
+    LOG(tout << "Merged " << coverage.size() << " bitmaps, new buckets: " << bitmapUpdates.size());
+
+    *updates = bitmapUpdates.data();
+    *updatesCount = bitmapUpdates.size();
+}
+
+CounterSlab* CoverageTracker::allocateCounters(int methodId, size_t capacity) {
+    auto slab = new CounterSlab(methodId, capacity);
+    counterSlabsMutex.lock();
+    counterSlabs.push_back(slab);
+    counterSlabsMutex.unlock();
+    return slab;
+}
+
+// Counters are not bound to threads, so all hits are reported as a single history of the current thread
+void CoverageTracker::collectCounters() {
+    CoverageHistory* history = nullptr;
+    counterSlabsMutex.lock();
+    for (auto slab : counterSlabs)
+        slab->addHits(history);
+    counterSlabsMutex.unlock();
+    if (history == nullptr)
+        return;
+    if (trackedCoverage.exist())
+        delete trackedCoverage.load();
+    trackedCoverage.storeOrUpdate(history);
+}
+
+void CoverageTracker::resetCounters() {
+    counterSlabsMutex.lock();
+    for (auto slab : counterSlabs)
+        slab->resetHits();
+    counterSlabsMutex.unlock();
+}
+
 size_t CoverageTracker::collectMethod(MethodInfo info) {
     collectedMethodsMutex.lock();
     size_t result = collectedMethods.size();
@@ -201,16 +424,27 @@ bool CoverageTracker::isCollectMainOnly() const {
     return collectMainOnly;
 }
 
+bool CoverageTracker::isCollectBitmap() const {
+    return collectBitmap;
+}
+
 void CoverageTracker::clear()  {
+    auto coverage = trackedCoverage.items();
     trackedCoverage.clear();
+    for (auto &history : coverage)
+        delete history.second;
 }
 
 CoverageTracker::~CoverageTracker(){
     clear();
+    releaseCoverageView();
+    for (auto slab : counterSlabs)
+        delete slab;
 }
 
 void CoverageTracker::invocationAborted() {
     trackedCoverage.update([](CoverageHistory *cov) {
+        delete cov;
         return (CoverageHistory*) nullptr;
     });
 }
@@ -3,21 +3,36 @@
 
 #include "logging.h"
 #include "memory.h"
+#include "bitmap.h"
 #include <vector>
 #include <algorithm>
+#include <memory>
 #include <mutex>
 
 namespace vsharp {
 
+// Probes are called via 'calli', whose signature tokens are different in every module
+enum ProbeSignatureKind {
+    OffsetSignature,            // (offset)
+    OffsetIdSignature,          // (offset, methodId)
+    OffsetIdIdSignature,        // (offset, methodId, isSpontaneous)
+    ProbeSignatureKindsCount
+};
+
+struct ProbeSignatures {
+    mdSignature tokens[ProbeSignatureKindsCount];
+};
+
+// The signatures of the module whose method is being instrumented by the current thread
+void setCurrentProbeSignatures(const ProbeSignatures *signatures);
+
 class ProbeCall {
-    std::map<ThreadID, mdSignature> threadMapping;
-    std::mutex threadMappingLock;
+    ProbeSignatureKind signatureKind;
 
 public:
     INT_PTR addr;
-    mdSignature getSig();
-    void setSig(mdSignature sig);
-    explicit ProbeCall(INT_PTR addr);
+    mdSignature getSig() const;
+    ProbeCall(INT_PTR addr, ProbeSignatureKind signatureKind);
 };
 
 enum CoverageEvent {
@@ -32,51 +47,147 @@ enum CoverageEvent {
     StsfldHit
 };
 
+// Names of a module and of its assembly, shared by all methods of the module; both include the null terminator
+struct ModuleNames {
+    std::vector<WCHAR> assemblyName;
+    std::vector<WCHAR> moduleName;
+};
+
 struct MethodInfo {
     mdMethodDef token;
-    ULONG assemblyNameLength;
-    WCHAR *assemblyName;
-    ULONG moduleNameLength;
-    WCHAR *moduleName;
+    std::shared_ptr<const ModuleNames> names;
 
     void serialize(std::vector<char>& buffer) const;
 };
 
+// NOTE: layout must match 'RawCoverageLocation' from VSharp.Utils/CoverageDeserializer.fs
+#pragma pack(push, 1)
 struct CoverageRecord {
     OFFSET offset;
     CoverageEvent event;
-    ThreadID thread;
     int methodId;
+    ThreadID thread;
+};
+#pragma pack(pop)
 
-    void serialize(std::vector<char>& buffer) const;
+static_assert(sizeof(CoverageRecord) == 20, "CoverageRecord must be serialized as 20 bytes");
+
+struct CoverageChunk {
+    static const size_t capacity = 2048;
+    size_t count;
+    CoverageRecord records[capacity];
 };
 
+// Keeps chunks of finished histories to reuse them for the next invocations
+class CoverageChunkPool {
+private:
+    std::mutex freeChunksMutex;
+    std::vector<CoverageChunk*> freeChunks;
+public:
+    CoverageChunk* acquire();
+    void release(CoverageChunk* chunk);
+    ~CoverageChunkPool();
+};
+
+// Points to records of a single chunk in place; the history owning the chunk is kept alive until the view is released
+// NOTE: layout must match 'CoverageChunkDescriptor' from VSharp.Utils/CoverageDeserializer.fs
+struct CoverageChunkDescriptor {
+    const CoverageRecord* records;
+    INT32 recordsCount;
+    INT32 threadId;
+    INT32 historyIndex;
+    INT32 aborted;
+};
+
+static_assert(sizeof(CoverageChunkDescriptor) == 24, "CoverageChunkDescriptor must be passed as 24 bytes");
+
 class CoverageHistory {
 private:
-    std::vector<CoverageRecord*> records{};
+    ThreadID thread;
+    size_t recordsCount;
+    std::vector<CoverageChunk*> chunks;
+    CoverageChunk* currentChunk;
+    CoverageBitmap* bitmap;
 public:
-    explicit CoverageHistory(OFFSET offset, int methodId);
+    explicit CoverageHistory(OFFSET offset, int methodId, bool collectBitmap);
+    // empty history, its records are added with their own events
+    explicit CoverageHistory(bool collectBitmap);
     void addCoverage(OFFSET offset, CoverageEvent event, int methodId);
     void serialize(std::vector<char>& buffer) const;
+    void describe(INT32 threadId, INT32 historyIndex, std::vector<CoverageChunkDescriptor>& descriptors) const;
+    const CoverageBitmap* getBitmap() const;
     ~CoverageHistory();
 
     std::set<int> visitedMethods;
 };
 
+// Saturating hit counters of one method's coverage points, incremented by IL inlined instead of probe calls;
+// points of one straight-line region are always reached together, so they share a counter
+// NOTE: the first point is always the method's enter
+class CounterSlab {
+public:
+    struct Point {
+        OFFSET offset;
+        CoverageEvent event;
+        size_t counter;
+    };
+private:
+    std::vector<Point> points;
+    std::map<unsigned, size_t> regionCounters;
+    size_t countersCount;
+    size_t capacity;
+    BYTE* counters;
+public:
+    const int methodId;
+
+    CounterSlab(int methodId, size_t capacity);
+    BYTE* addPoint(OFFSET offset, CoverageEvent event);
+    BYTE* addPoint(OFFSET offset, CoverageEvent event, unsigned region);
+    void restorePoint(OFFSET offset, CoverageEvent event, size_t counter);
+    const std::vector<Point>& getPoints() const;
+    BYTE* counterAt(size_t index) const;
+    size_t counterIndex(const BYTE* counter) const;
+    void addHits(CoverageHistory*& history) const;
+    size_t countersUsed() const;
+    size_t pointsCount() const;
+    void resetHits();
+    ~CounterSlab();
+};
+
 class CoverageTracker {
 
 private:
     bool collectMainOnly;
+    bool collectBitmap;
     std::mutex collectedMethodsMutex;
     std::vector<MethodInfo> collectedMethods;
     ThreadStorage<CoverageHistory*> trackedCoverage;
+
+    std::vector<CoverageHistory*> viewHistories;
+    std::vector<CoverageChunkDescriptor> viewDescriptors;
+    std::vector<char> viewMethods;
+
+    VirginBitmap virginBitmap;
+    std::vector<BitmapUpdate> bitmapUpdates;
+
+    std::mutex counterSlabsMutex;
+    std::vector<CounterSlab*> counterSlabs;
+
+    void serializeVisitedMethods(const std::vector<std::pair<ThreadID, CoverageHistory*>>& coverage, std::vector<char>& buffer);
 public:
-    explicit CoverageTracker(bool collectMainOnly);
+    explicit CoverageTracker(bool collectMainOnly, bool collectBitmap);
     bool isCollectMainOnly() const;
+    bool isCollectBitmap() const;
     void addCoverage(OFFSET offset, CoverageEvent event, int methodId);
     void invocationAborted();
     size_t collectMethod(MethodInfo info);
     char* serializeCoverageReport(size_t* size);
+    void publishCoverageView(char** methods, size_t* methodsSize, CoverageChunkDescriptor** descriptors, size_t* descriptorsCount);
+    void releaseCoverageView();
+    void mergeBitmaps(BitmapUpdate** updates, size_t* updatesCount);
+    CounterSlab* allocateCounters(int methodId, size_t capacity);
+    void collectCounters();
+    void resetCounters();
     void clear();
     ~CoverageTracker();
 };
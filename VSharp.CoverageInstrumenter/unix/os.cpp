@@ -1,5 +1,6 @@
 #include "./profiler/os.h"
 
+#include <dlfcn.h>
 #include <unistd.h>
 
 std::string OS::unicodeToAnsi(const WCHAR *str) {
@@ -9,4 +10,11 @@ std::string OS::unicodeToAnsi(const WCHAR *str) {
 
 void OS::sleepSeconds(int seconds) {
     sleep(seconds);
+}
+
+std::string OS::profilerImagePath() {
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void *>(&OS::profilerImagePath), &info) == 0 || info.dli_fname == nullptr)
+        return "";
+    return info.dli_fname;
 }
\ No newline at end of file
@@ -9,4 +9,16 @@ std::string OS::unicodeToAnsi(const WCHAR *str) {
 
 void OS::sleepSeconds(int seconds) {
     Sleep(seconds * 1000);
+}
+
+std::string OS::profilerImagePath() {
+    HMODULE module;
+    auto flags = GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT;
+    if (!GetModuleHandleExA(flags, reinterpret_cast<LPCSTR>(&OS::profilerImagePath), &module))
+        return "";
+    char path[MAX_PATH];
+    DWORD length = GetModuleFileNameA(module, path, MAX_PATH);
+    if (length == 0 || length == MAX_PATH)
+        return "";
+    return std::string(path, length);
 }
\ No newline at end of file
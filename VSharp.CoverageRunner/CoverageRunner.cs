@@ -8,6 +8,7 @@ namespace VSharp.CoverageRunner
     public static class CoverageRunner
     {
         private const string ResultName = "coverage.cov";
+        private const string EntryMethodsName = "coverage.methods";
 
         private static string GetProfilerPath()
         {
@@ -62,11 +63,11 @@ namespace VSharp.CoverageRunner
             return proc.ExitCode == 0;
         }
 
-        private static bool StartCoverageTool(string args, DirectoryInfo workingDirectory, MethodBase method)
+        private static ProcessStartInfo CoverageToolInfo(string args, DirectoryInfo workingDirectory)
         {
             var profilerPath = GetProfilerPath();
 
-            var info = new ProcessStartInfo
+            return new ProcessStartInfo
             {
                 EnvironmentVariables =
                     {
@@ -75,32 +76,57 @@ namespace VSharp.CoverageRunner
                         ["CORECLR_PROFILER_PATH"] = profilerPath,
                         ["COVERAGE_ENABLE_PASSIVE"] = "1",
                         ["COVERAGE_RESULT_NAME"] = ResultName,
-                        ["COVERAGE_METHOD_ASSEMBLY_NAME"] = method.Module.Assembly.FullName,
-                        ["COVERAGE_METHOD_MODULE_NAME"] = method.Module.FullyQualifiedName,
-                        ["COVERAGE_METHOD_TOKEN"] = method.MetadataToken.ToString(),
-                        ["COVERAGE_INSTRUMENT_MAIN_ONLY"] = "1"
+                        ["COVERAGE_INSTRUMENT_MAIN_ONLY"] = "1",
+                        ["COVERAGE_INLINE_COUNTERS"] = "1"
                     },
                 WorkingDirectory = workingDirectory.FullName,
                 FileName = "dotnet",
                 Arguments = args
             };
+        }
+
+        private static bool StartCoverageTool(string args, DirectoryInfo workingDirectory, MethodBase method)
+        {
+            var info = CoverageToolInfo(args, workingDirectory);
+            info.EnvironmentVariables["COVERAGE_METHOD_ASSEMBLY_NAME"] = method.Module.Assembly.FullName;
+            info.EnvironmentVariables["COVERAGE_METHOD_MODULE_NAME"] = method.Module.FullyQualifiedName;
+            info.EnvironmentVariables["COVERAGE_METHOD_TOKEN"] = method.MetadataToken.ToString();
 
             return RunWithLogging(info);
         }
 
-        private static CoverageReport[]? GetHistory(DirectoryInfo workingDirectory)
+        // All methods are instrumented in one process; the test runner reports boundaries of its tests to the tool
+        private static bool StartBatchCoverageTool(string args, DirectoryInfo workingDirectory, IEnumerable<MethodBase> methods)
+        {
+            var entryMethodsPath = Path.Combine(workingDirectory.FullName, EntryMethodsName);
+            File.WriteAllLines(entryMethodsPath,
+                methods.Select(method => $"{method.MetadataToken} {method.Module.FullyQualifiedName}"));
+
+            var info = CoverageToolInfo(args, workingDirectory);
+            info.EnvironmentVariables["COVERAGE_ENTRY_METHODS_FILE"] = entryMethodsPath;
+
+            return RunWithLogging(info);
+        }
+
+        private static byte[]? ReadHistory(DirectoryInfo workingDirectory)
         {
-            byte[] covHistory;
             try
             {
                 var coverageFile = workingDirectory.EnumerateFiles(ResultName).Single();
-                covHistory = File.ReadAllBytes(coverageFile.FullName);
+                return File.ReadAllBytes(coverageFile.FullName);
             }
             catch
             {
                 Logger.printLogString(Logger.Error, "CoverageRunner could not read/access coverage history file");
                 return null;
             }
+        }
+
+        private static CoverageReport[]? GetHistory(DirectoryInfo workingDirectory)
+        {
+            var covHistory = ReadHistory(workingDirectory);
+            if (covHistory is null)
+                return null;
 
             var raw = CoverageDeserializer.getRawReports(covHistory);
             return CoverageDeserializer.reportsFromRawReports(raw);
@@ -179,5 +205,51 @@ namespace VSharp.CoverageRunner
             }
             return ComputeCoverage(method.CFG, reports, methodInfo);
         }
+
+        /// <summary>
+        /// Runs all tests of the working directory once, with all methods instrumented, and returns coverage of each
+        /// method by each test, keyed by the full name of the test file (tests which crashed before reporting are absent);
+        /// null if the run failed
+        /// </summary>
+        public static Dictionary<string, int[]>? RunAndGetBatchCoverage(string args, DirectoryInfo workingDirectory, IReadOnlyList<MethodBase> methods)
+        {
+            var success = StartBatchCoverageTool(args, workingDirectory, methods);
+            if (!success)
+            {
+                Logger.printLogString(Logger.Error, "TestRunner with Coverage failed to run!");
+                return null;
+            }
+
+            var covHistory = ReadHistory(workingDirectory);
+            if (covHistory is null)
+                return null;
+
+            // ids of the tests are their positions in the order of the test runner, which sorts them by full name
+            var tests = workingDirectory.EnumerateFiles("*.vst")
+                .OrderBy(test => test.FullName, StringComparer.Ordinal)
+                .ToList();
+            var cfgs = methods.Select(methodInfo =>
+            {
+                var method = Application.getMethod(methodInfo);
+                return method.HasBody ? method.CFG : null;
+            }).ToArray();
+
+            var result = new Dictionary<string, int[]>();
+            foreach (var (testId, raw) in CoverageDeserializer.getBatchRawReports(covHistory))
+            {
+                if (testId < 0 || testId >= tests.Count)
+                {
+                    Logger.printLogString(Logger.Error, $"CoverageRunner got coverage of unknown test {testId}");
+                    continue;
+                }
+
+                var reports = CoverageDeserializer.reportsFromRawReports(raw);
+                result[tests[testId].FullName] =
+                    methods.Select((methodInfo, i) => cfgs[i] is { } cfg ? ComputeCoverage(cfg, reports, methodInfo) : 100)
+                        .ToArray();
+            }
+
+            return result;
+        }
     }
 }
@@ -14,7 +14,7 @@ open VSharp.Fuzzer.Communication.Services
 
 type internal Application (fuzzerOptions: Startup.FuzzerOptions) =
     let fuzzerCancellationToken = new CancellationTokenSource()
-    let coverageTool = CoverageTool()
+    let coverageTool = CoverageTool(fuzzerOptions.bitmapCoverage)
     let masterProcessService = connectMasterProcessService ()
     let fuzzer = Fuzzer.Fuzzer(fuzzerOptions, masterProcessService, coverageTool)
 
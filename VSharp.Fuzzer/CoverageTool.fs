@@ -1,5 +1,6 @@
 namespace VSharp.Fuzzer
 
+open System
 open System.Reflection
 open System.Runtime.InteropServices
 open Microsoft.FSharp.NativeInterop
@@ -14,15 +15,30 @@ module private ExternalCalls =
     [<DllImport("libvsharpCoverage", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Ansi)>]
     extern void GetHistory(nativeint size, nativeint data)
 
+    [<DllImport("libvsharpCoverage", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Ansi)>]
+    extern void GetHistoryView(nativeint methodsSize, nativeint methodsData, nativeint descriptorsCount, nativeint descriptors)
+
+    [<DllImport("libvsharpCoverage", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Ansi)>]
+    extern void ReleaseHistoryView()
+
+    [<DllImport("libvsharpCoverage", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Ansi)>]
+    extern void MergeCoverageBitmaps(nativeint updatesCount, nativeint updates)
+
     [<DllImport("libvsharpCoverage", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Ansi)>]
     extern void SetCurrentThreadId(int id)
 
     let inline castPtr ptr =
         ptr |> NativePtr.toVoidPtr |> NativePtr.ofVoidPtr
 
-type internal CoverageTool() =
+type internal CoverageTool(collectBitmap: bool) =
     let mutable entryMainWasSet = false
 
+    let failIfBitmapMode name =
+        if collectBitmap then Prelude.internalfail $"Try call {name}, while coverage tool collects bitmaps"
+
+    let failIfTraceMode name =
+        if not collectBitmap then Prelude.internalfail $"Try call {name}, while coverage tool doesn't collect bitmaps"
+
     do
         if Startup.isCoverageToolAttached () |> not then internalfail "Coverage tool wasn't attached"
 
@@ -40,6 +56,52 @@ type internal CoverageTool() =
         Marshal.Copy(dataPtr, data, 0, size)
         data
 
+    // Histories of the bitmap mode have no trace, use 'GetBitmapReports' or 'MergeBitmaps' instead
+    member this.GetRawReports () =
+        if not entryMainWasSet then Prelude.internalfail "Try call GetRawReports, while entryMain wasn't set"
+        failIfBitmapMode "GetRawReports"
+        let methodsSizePtr = NativePtr.stackalloc<uint> 1
+        let methodsPtrPtr = NativePtr.stackalloc<nativeint> 1
+        let descriptorsCountPtr = NativePtr.stackalloc<uint> 1
+        let descriptorsPtrPtr = NativePtr.stackalloc<nativeint> 1
+
+        ExternalCalls.GetHistoryView(
+            NativePtr.toNativeInt methodsSizePtr,
+            NativePtr.toNativeInt methodsPtrPtr,
+            NativePtr.toNativeInt descriptorsCountPtr,
+            NativePtr.toNativeInt descriptorsPtrPtr
+        )
+
+        try
+            let methodsSize = NativePtr.read methodsSizePtr |> int
+            let methods = Array.zeroCreate<byte> methodsSize
+            Marshal.Copy(NativePtr.read methodsPtrPtr, methods, 0, methodsSize)
+
+            let descriptorsCount = NativePtr.read descriptorsCountPtr |> int
+            let descriptorsPtr = NativePtr.read descriptorsPtrPtr
+            let descriptors = ReadOnlySpan<CoverageChunkDescriptor>(descriptorsPtr.ToPointer(), descriptorsCount).ToArray()
+
+            CoverageDeserializer.getRawReportsFromView methods descriptors
+        finally
+            ExternalCalls.ReleaseHistoryView()
+
+    member this.GetBitmapReports () =
+        failIfTraceMode "GetBitmapReports"
+        this.GetRawHistory () |> CoverageDeserializer.getBitmapReports
+
+    // Available only when the coverage tool collects bitmaps, consumes the collected coverage
+    member this.MergeBitmaps () =
+        if not entryMainWasSet then Prelude.internalfail "Try call MergeBitmaps, while entryMain wasn't set"
+        failIfTraceMode "MergeBitmaps"
+        let countPtr = NativePtr.stackalloc<uint> 1
+        let updatesPtrPtr = NativePtr.stackalloc<nativeint> 1
+
+        ExternalCalls.MergeCoverageBitmaps(NativePtr.toNativeInt countPtr, NativePtr.toNativeInt updatesPtrPtr)
+
+        let count = NativePtr.read countPtr |> int
+        let updatesPtr = NativePtr.read updatesPtrPtr
+        ReadOnlySpan<BitmapUpdate>(updatesPtr.ToPointer(), count).ToArray()
+
     member this.SetEntryMain (assembly: Assembly) (moduleName: string) (methodToken: int) =
         entryMainWasSet <- true
         let assemblyNamePtr = fixed assembly.FullName.ToCharArray()
@@ -55,5 +117,7 @@ type internal CoverageTool() =
             methodToken
         )
 
+    member this.IsCollectBitmap = collectBitmap
+
     member this.SetCurrentThreadId id =
         ExternalCalls.SetCurrentThreadId(id)
@@ -132,7 +132,23 @@ type internal Fuzzer(
         ignoredCount <- 0
         abortedCount <- 0
 
-    let handleResults (method: Method) result =
+    let saveTest generationData invocationResult =
+        let test = fuzzingResultToTest generationData invocationResult
+        match test with
+        | Some test ->
+            let testPath = $"{currentOutputDir}{Path.DirectorySeparatorChar}fuzzer_test_{testIdGenerator.NextId()}.vst"
+            generatedCount <- generatedCount + 1
+            Task.Run(fun () ->
+                test.Serialize(testPath)
+                infoFuzzing $"Generated test: {testPath}"
+            ).ForgetUntilExecutionRequested() // TODO: Maybe just serialize after finished?
+            infoFuzzing "Test will be generated"
+        | None ->
+            infoFuzzing "Failed to create test"
+            ignoredCount <- ignoredCount + 1
+            ()
+
+    let handleTraceResults (method: Method) result =
 
         let onCollected (methods: Dictionary<int, RawMethodInfo>) coverageReport generationData invocationResult =
             task {
@@ -158,20 +174,7 @@ type internal Fuzzer(
                 })
 
                 if isNewCoverage.boolValue then
-                    let test = fuzzingResultToTest generationData invocationResult
-                    match test with
-                    | Some test ->
-                        let testPath = $"{currentOutputDir}{Path.DirectorySeparatorChar}fuzzer_test_{testIdGenerator.NextId()}.vst"
-                        generatedCount <- generatedCount + 1
-                        Task.Run(fun () ->
-                            test.Serialize(testPath)
-                            infoFuzzing $"Generated test: {testPath}"
-                        ).ForgetUntilExecutionRequested() // TODO: Maybe just serialize after finished?
-                        infoFuzzing "Test will be generated"
-                    | None ->
-                        infoFuzzing "Failed to create test"
-                        ignoredCount <- ignoredCount + 1
-                        ()
+                    saveTest generationData invocationResult
                 else
                     ignoredCount <- ignoredCount + 1
                     infoFuzzing "Coverage already tracked"
@@ -181,10 +184,8 @@ type internal Fuzzer(
             let (threadIds: int[], data: GenerationData[], invocationResults: InvocationResult[]) = result
             let indices = [|0..batchSize - 1|]
             traceFuzzing "Coverage requested"
-            let rawCoverage = coverageTool.GetRawHistory()
+            let coverages = coverageTool.GetRawReports()
             traceFuzzing "Coverage received"
-            let coverages = CoverageDeserializer.getRawReports rawCoverage
-            traceFuzzing "Coverage deserialized"
             assert (coverages.reports.Length = batchSize)
             let coverages = {
                 methods = coverages.methods
@@ -209,6 +210,32 @@ type internal Fuzzer(
                     do! onCollected coverages.methods coverage generationData invocationResult
         }
 
+    // Novelty is decided by the coverage tool: a run is new iff it hit a new edge or a new hit count bucket
+    let handleBitmapResults result =
+        task {
+            let (threadIds: int[], data: GenerationData[], invocationResults: InvocationResult[]) = result
+            traceFuzzing "Bitmaps merge requested"
+            let updates = coverageTool.MergeBitmaps()
+            traceFuzzing $"Bitmaps merged, updates: {updates.Length}"
+            let novelThreads = updates |> Seq.map (fun x -> x.threadId) |> HashSet<int>
+            for i in 0..batchSize - 1 do
+                let invocationResult = invocationResults[i]
+                traceFuzzing $"Handler result for {threadIds[i]}"
+                if Utils.isNull invocationResult then
+                    abortedCount <- abortedCount + 1
+                    traceFuzzing "Aborted"
+                elif novelThreads.Contains(threadIds[i]) then
+                    traceFuzzing "Invoked"
+                    saveTest data[i] invocationResult
+                else
+                    ignoredCount <- ignoredCount + 1
+                    infoFuzzing "Coverage already tracked"
+        }
+
+    let handleResults (method: Method) result =
+        if fuzzerOptions.bitmapCoverage then handleBitmapResults result
+        else handleTraceResults method result
+
     member this.AsyncFuzz (method: Method) =
         task {
             try
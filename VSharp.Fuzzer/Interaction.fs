@@ -67,6 +67,7 @@ type Interactor (
             timeLimitPerMethod = 3000
             arrayMaxSize = 10
             stringMaxSize = 10
+            bitmapCoverage = false
         }
 
     let fuzzerDeveloperOptions =
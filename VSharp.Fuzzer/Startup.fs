@@ -9,6 +9,8 @@ type internal FuzzerOptions = {
     timeLimitPerMethod: int
     arrayMaxSize: int
     stringMaxSize: int
+    // Coverage tool collects edge hit bitmaps instead of full traces, novelty is decided by the tool itself
+    bitmapCoverage: bool
 }
 
 type internal SanitizersMode =
@@ -47,6 +49,7 @@ let internal fuzzerOptionsFromEnv () =
         timeLimitPerMethod = fromEnv "TIME_LIMIT" |> int
         arrayMaxSize = fromEnv "ARRAY_MAX_SIZE" |> int
         stringMaxSize = fromEnv "STRING_MAX_SIZE" |> int
+        bitmapCoverage = optionalFromEnv "COVERAGE_BITMAP_MODE" = Some enabled
     }
 
 let internal getLogPath () =
@@ -93,6 +96,8 @@ let internal startFuzzer options developerOptions =
     info.EnvironmentVariables["TIME_LIMIT"] <- options.timeLimitPerMethod |> string
     info.EnvironmentVariables["ARRAY_MAX_SIZE"] <- options.arrayMaxSize |> string
     info.EnvironmentVariables["STRING_MAX_SIZE"] <- options.stringMaxSize |> string
+    if options.bitmapCoverage then
+        info.EnvironmentVariables["COVERAGE_BITMAP_MODE"] <- enabled
 
     if developerOptions.redirectStderr then
         info.RedirectStandardError <- true
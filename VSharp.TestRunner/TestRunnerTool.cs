@@ -3,6 +3,7 @@ using System;
 using System.IO;
 using System.Linq;
 using System.Reflection;
+using System.Runtime.InteropServices;
 using System.Runtime.Serialization;
 using static VSharp.TestExtensions.ObjectsComparer;
 
@@ -10,6 +11,16 @@ namespace VSharp.TestRunner
 {
     public static class TestRunner
     {
+        // Set by the coverage runner, when coverage of all tests is collected by one profiled process
+        private static readonly bool IsCoverageBatchRun =
+            Environment.GetEnvironmentVariable("COVERAGE_ENTRY_METHODS_FILE") != null;
+
+        [DllImport("libvsharpCoverage", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void BeginTest(int testId);
+
+        [DllImport("libvsharpCoverage", CallingConvention = CallingConvention.Cdecl)]
+        private static extern void EndTest(int testId);
+
         private static unsafe bool CheckResult(object? expected, object? got)
         {
             return (expected, got) switch
@@ -134,6 +145,9 @@ namespace VSharp.TestRunner
         {
             var tests = testsDir.EnumerateFiles("*.vst", recursive ? SearchOption.AllDirectories : SearchOption.TopDirectoryOnly);
             var testsList = tests.ToList();
+            // ids of the tests reported to the coverage tool are their positions in this order
+            if (IsCoverageBatchRun)
+                testsList.Sort((x, y) => string.CompareOrdinal(x.FullName, y.FullName));
 
             if (testsList.Count == 0)
             {
@@ -145,9 +159,13 @@ namespace VSharp.TestRunner
 
             var result = true;
 
-            foreach (var testFileInfo in testsList)
+            for (var testId = 0; testId < testsList.Count; testId++)
             {
-                result &= ReproduceTest(testFileInfo, suiteType, true);
+                if (IsCoverageBatchRun)
+                    BeginTest(testId);
+                result &= ReproduceTest(testsList[testId], suiteType, true);
+                if (IsCoverageBatchRun)
+                    EndTest(testId);
             }
 
             return result;
@@ -27,6 +27,27 @@ type RawCoverageLocation = {
     [<FieldOffset(12); DataMember(Order = 4)>] threadId: uint64
 }
 
+// Layout must match 'CoverageChunkDescriptor' from VSharp.CoverageInstrumenter/profiler/probes.h
+[<Struct; CLIMutable>]
+[<StructLayout(LayoutKind.Explicit, Size = 24)>]
+type CoverageChunkDescriptor = {
+    [<FieldOffset(00)>] records: nativeint
+    [<FieldOffset(08)>] recordsCount: int32
+    [<FieldOffset(12)>] threadId: int32
+    [<FieldOffset(16)>] historyIndex: int32
+    [<FieldOffset(20)>] aborted: int32
+}
+
+// Layout must match 'BitmapUpdate' from VSharp.CoverageInstrumenter/profiler/bitmap.h
+[<Struct; CLIMutable>]
+[<StructLayout(LayoutKind.Explicit, Size = 16)>]
+type BitmapUpdate = {
+    [<FieldOffset(00)>] threadId: int32
+    [<FieldOffset(04)>] edge: uint32
+    [<FieldOffset(08)>] newBuckets: uint32
+    [<FieldOffset(12)>] isNewEdge: int32
+}
+
 type RawMethodInfo = {
     methodToken: uint32 
     moduleName: string
@@ -43,6 +64,17 @@ type RawCoverageReports = {
     reports: RawCoverageReport[]
 }
 
+// Edge hit counts collected by the coverage tool in 'COVERAGE_BITMAP_MODE'
+type BitmapCoverageReport = {
+    threadId: int
+    hitCounts: byte[]
+}
+
+type BitmapCoverageReports = {
+    methods: System.Collections.Generic.Dictionary<int, RawMethodInfo>
+    bitmaps: BitmapCoverageReport[]
+}
+
 module CoverageDeserializer =
 
     let mutable private data = [||]
@@ -132,6 +164,23 @@ module CoverageDeserializer =
             reports = reports
         }
 
+    let private deserializeBitmapReport () =
+        let threadId = readInt32 ()
+        let threadAborted = readInt32 ()
+        if threadAborted = 1 then
+            {
+                threadId = threadId
+                hitCounts = [||]
+            }
+        else
+            let size = readInt32 ()
+            let hitCounts = Array.sub data dataOffset size
+            increaseOffset size
+            {
+                threadId = threadId
+                hitCounts = hitCounts
+            }
+
     let private startNewDeserialization bytes =
         data <- bytes
         dataOffset <- 0
@@ -150,6 +199,68 @@ module CoverageDeserializer =
             Logger.error $"{e.Message}\n\n{e.StackTrace}"
             failwith "CoverageDeserialization failed!"
 
+    let getBitmapReports bytes =
+        try
+            startNewDeserialization bytes
+            let methods = deserializeDictionary readInt32 deserializeMethodData
+            let bitmaps = deserializeArray deserializeBitmapReport
+            {
+                methods = methods
+                bitmaps = bitmaps
+            }
+        with
+        | e ->
+            Logger.error $"{dataOffset}"
+            Logger.error $"{e.Message}\n\n{e.StackTrace}"
+            failwith "CoverageDeserialization failed!"
+
+    // Reports of the batch run are written by the coverage tool as [testId][size][report] frames, one per test
+    let getBatchRawReports (bytes: byte[]) =
+        let reports = System.Collections.Generic.Dictionary<int, RawCoverageReports>()
+        let mutable frameOffset = 0
+        while frameOffset + 2 * sizeof<int32> <= bytes.Length do
+            let testId = BitConverter.ToInt32(bytes, frameOffset)
+            let size = BitConverter.ToInt32(bytes, frameOffset + sizeof<int32>)
+            let reportOffset = frameOffset + 2 * sizeof<int32>
+            // the last frame may be truncated if the process was killed while writing it
+            if reportOffset + size <= bytes.Length then
+                reports[testId] <- getRawReports (Array.sub bytes reportOffset size)
+            frameOffset <- reportOffset + size
+        reports
+
+    // Builds reports from chunks published by the coverage tool; records are copied straight from native memory,
+    // so descriptors must not be used after the view was released
+    let getRawReportsFromView methodsBytes (descriptors: CoverageChunkDescriptor[]) =
+        try
+            startNewDeserialization methodsBytes
+            let methods = deserializeDictionary readInt32 deserializeMethodData
+            let toReport (chunks: CoverageChunkDescriptor[]) =
+                let first = chunks[0]
+                if first.aborted = 1 then
+                    { threadId = first.threadId; rawCoverageLocations = [||] }
+                else
+                    let count = chunks |> Array.sumBy (fun chunk -> chunk.recordsCount)
+                    let locations = Array.zeroCreate count
+                    let mutable position = 0
+                    for chunk in chunks do
+                        let source = ReadOnlySpan<RawCoverageLocation>(chunk.records.ToPointer(), chunk.recordsCount)
+                        source.CopyTo(Span(locations, position, chunk.recordsCount))
+                        position <- position + chunk.recordsCount
+                    { threadId = first.threadId; rawCoverageLocations = locations }
+            let reports =
+                descriptors
+                |> Array.groupBy (fun chunk -> chunk.historyIndex)
+                |> Array.map (snd >> toReport)
+            {
+                methods = methods
+                reports = reports
+            }
+        with
+        | e ->
+            Logger.error $"{dataOffset}"
+            Logger.error $"{e.Message}\n\n{e.StackTrace}"
+            failwith "CoverageDeserialization failed!"
+
     let reportsFromRawReports (rawReports: RawCoverageReports) =
 
         let toLocation (x: RawCoverageLocation) =